@@ -1,360 +1,1587 @@
 #include "clustering.h"
 
-void Clustering::ClusterViews(const int block_size, const int min_points, const int min_cameras, const float max_distance)
+void Clustering::ClusterViews(const bool quadtree, 
+							  const int block_size, 
+							  const int max_points, 
+							  const int max_cameras, 
+							  const int min_points, 
+							  const int min_cameras, 
+							  const float max_distance)
 {
-	ComputePointCloudRange();
+	std::vector<int> all_points(data.points.size());
+	std::iota(all_points.begin(), all_points.end(), 0);
 
-	const int num_blocks_x = std::ceil(std::abs(x_max - x_min) / block_size);
-	const int num_blocks_z = std::ceil(std::abs(z_max - z_min) / block_size);
-	clusters.resize(num_blocks_x * num_blocks_z);
+	ClusterPoints(all_points, quadtree, block_size, max_points, max_cameras, min_points, min_cameras, max_distance);
+	modified.assign(clusters.size(), 1);
+}
+
+// Clusters the given points (in increasing order) from scratch, replacing the current clusters
+
+void Clustering::ClusterPoints(const std::vector<int>& point_idx, 
+							   const bool quadtree, 
+							   const int block_size, 
+							   const int max_points, 
+							   const int max_cameras, 
+							   const int min_points, 
+							   const int min_cameras, 
+							   const float max_distance)
+{
+	{
+		ScopedTimer timer("partition_points");
+		ComputePointCloudRange(point_idx);
+
+		if (quadtree)
+		{
+			BuildQuadtree(point_idx, max_points, max_cameras, max_distance);
+		}
+		else
+		{
+			const int num_blocks_x = std::max<int>(1, std::ceil(std::abs(x_max - x_min) / block_size));
+			const int num_blocks_z = std::max<int>(1, std::ceil(std::abs(z_max - z_min) / block_size));
+			clusters.assign(num_blocks_x * num_blocks_z, Cluster());
+
+			AssignPointsToBlock(point_idx, block_size, num_blocks_x);
+			ComputeGridAdjacency(num_blocks_x);
+		}
+	}
+
+	{
+		ScopedTimer timer("merge_blocks_by_points");
+		MergeUndersizedBlocks(min_points, false);
+	}
 
-	AssignPointsToBlock(block_size, num_blocks_x);
+	{
+		ScopedTimer timer("assign_cameras");
+		AssignCamerasToBlock(max_distance);
+	}
 
-	GroupByPoints(min_points, num_blocks_x);
+	{
+		ScopedTimer timer("merge_blocks_by_cameras");
+		MergeUndersizedBlocks(min_cameras, true);
+	}
 
-	AssignCamerasToBlock(max_distance);
+	// Merging may push clusters past the budgets, which are checked again. The grid bounds blocks
+	// by their size, not by their number of points.
 
-	GroupByCameras(min_cameras, num_blocks_x);
+	const int point_budget = quadtree ? max_points : 0;
+	if (point_budget > 0 || max_cameras > 0)
+	{
+		ScopedTimer timer("split_clusters");
+		SplitOversizedClusters(point_budget, max_cameras, max_distance);
+	}
 
-	const auto lambda_size = [](const Cluster& c){ return c.point_idx.empty() || c.camera_idx.empty(); };
+	const auto lambda_size = [](const Cluster& c){ return c.point_idx.empty() || c.camera_idx.Empty(); };
 	clusters.erase(std::remove_if(clusters.begin(), clusters.end(), lambda_size), clusters.end());
 }
 
-void Clustering::ComputeNeighbors(const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0)
+// Incremental update after frames and points were appended to the sequence of a previous run,
+// whose clusters were restored by LoadState. Old points stay in their cluster, and a new point
+// joins the first cluster with a point in the same square of side block_size. The remaining new
+// points are clustered from scratch and their clusters are appended. Old clusters are modified
+// when they gain points or cameras: their cameras are collected again and they are split if
+// they grow beyond the budgets of ClusterPoints, the first part keeping the index of the cluster.
+
+void Clustering::UpdateClusters(const int num_old_images,
+								const bool quadtree, 
+								const int block_size, 
+								const int max_points, 
+								const int max_cameras, 
+								const int min_points, 
+								const int min_cameras, 
+								const float max_distance)
 {
-	std::vector<std::thread> th_vec;
+	const int num_old_clusters = clusters.size();
+	modified.resize(num_old_clusters, 0);
 
-	for (int i = 0; i < clusters.size(); i++)
+	std::vector<int> owner(data.points.size(), -1);
+	for (int i = 0; i < num_old_clusters; i++)
+	{
+		for (const auto& p : clusters[i].point_idx)
+		{
+			owner[p] = i;
+		}
+	}
+
+	const auto square_of = [&](const int p)
+	{
+		const int64_t x = std::floor(data.points.x[p] / block_size);
+		const int64_t z = std::floor(data.points.z[p] / block_size);
+		return (static_cast<uint64_t>(x) << 32) ^ static_cast<uint32_t>(z);
+	};
+
+	std::unordered_map<uint64_t, int> square_owner;
+	for (int i = 0; i < num_old_clusters; i++)
+	{
+		for (const auto& p : clusters[i].point_idx)
+		{
+			square_owner.insert(std::make_pair(square_of(p), i));
+		}
+	}
+
+	std::vector<int> new_points;
+	for (int p = 0; p < data.points.size(); p++)
+	{
+		if (owner[p] != -1)
+		{
+			continue;
+		}
+
+		const auto it = square_owner.find(square_of(p));
+		if (it != square_owner.end())
+		{
+			clusters[it->second].point_idx.push_back(p);
+			modified[it->second] = 1;
+		}
+		else
+		{
+			new_points.push_back(p);
+		}
+	}
+
+	// Old clusters with a point seen by a new camera, even too far to join them, as the track of
+	// the point is written with the cluster
+
+	for (int uuid = num_old_images; uuid < data.images.size(); uuid++)
+	{
+		for (const Feature* f = data.FeaturesBegin(uuid); f != data.FeaturesEnd(uuid); f++)
+		{
+			if (owner[f->point_idx] != -1)
+			{
+				modified[owner[f->point_idx]] = 1;
+			}
+		}
+	}
+
+	std::vector<int> updated;
+	for (int i = 0; i < num_old_clusters; i++)
+	{
+		if (modified[i])
+		{
+			updated.push_back(i);
+		}
+	}
+
+	const auto collect_cameras = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t j = begin; j < end; j++)
+		{
+			Cluster& c = clusters[updated[j]];
+			std::sort(c.point_idx.begin(), c.point_idx.end());
+			c.camera_idx = CollectCameras(c.point_idx, max_distance);
+			c.neighbors.clear();
+		}
+	};
+	ParallelFor(updated.size(), data.num_threads, collect_cameras);
+
+	std::vector<Cluster> appended;
+	int num_kept = 0;
+	const int point_budget = quadtree ? max_points : 0;
+	for (const auto& i : updated)
 	{
-		for (const auto& uuid : clusters[i].camera_idx)
+		if (IsOversized(clusters[i].point_idx, clusters[i].camera_idx, point_budget, max_cameras))
 		{
-			const int sensor = uuid / data.num_frames;
-			const int frame = uuid - sensor * data.num_frames;
-			
-			std::sort(data.images[frame][sensor].features.begin(),
-					  data.images[frame][sensor].features.end());
+			std::vector<Cluster> parts;
+			SplitAlongPrincipalAxis(clusters[i].point_idx, clusters[i].camera_idx, point_budget, max_cameras, max_distance, parts);
+			num_kept += CountUnsplittable(parts, 0, max_cameras);
+			clusters[i] = std::move(parts[0]);
+			std::move(parts.begin() + 1, parts.end(), std::back_inserter(appended));
 		}
-		th_vec.push_back(std::thread(&Clustering::ComputeNeighborsForCluster, this, i, num_neighbors, sigma_0, sigma_1, theta_0));
+	}
+	const int num_split = appended.size();
+	if (num_kept > 0)
+	{
+		std::cout << "Warning: " << num_kept << " clusters with a single point are seen by more than " 
+				  << max_cameras << " cameras, they are kept" << std::endl;
 	}
 
-	for (auto& th : th_vec)
+	if (!new_points.empty())
 	{
-		th.join();
+		std::vector<Cluster> old_clusters;
+		old_clusters.swap(clusters);
+		ClusterPoints(new_points, quadtree, block_size, max_points, max_cameras, min_points, min_cameras, max_distance);
+		std::move(clusters.begin(), clusters.end(), std::back_inserter(appended));
+		clusters.swap(old_clusters);
 	}
+
+	std::move(appended.begin(), appended.end(), std::back_inserter(clusters));
+	modified.resize(clusters.size(), 1);
+	Profiler::Get().Count("modified_clusters", updated.size() + appended.size());
+
+	std::cout << "Updated " << updated.size() << " of " << num_old_clusters << " clusters, added " << num_split 
+			  << " clusters from splits and " << appended.size() - num_split << " clusters for " 
+			  << new_points.size() << " new points" << std::endl;
 }
 
-bool Clustering::WriteColmapFiles(const std::string& output_path)
+bool Clustering::SaveSnapshot(const std::string& filename, const uint64_t key) const
 {
-	for (int i = 0; i < clusters.size(); i++)
+	SnapshotWriter out;
+	if (!out.Open(filename, key))
 	{
-		const std::string cluster_folder = output_path + "cluster_" + std::to_string(i) + "/";
-		if (mkdir(cluster_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+		return false;
+	}
+
+	out.Write<uint64_t>(clusters.size());
+	for (const auto& cluster : clusters)
+	{
+		out.WriteVector(cluster.point_idx);
+		out.WriteVector(cluster.camera_idx.words);
+	}
+
+	return out.Close();
+}
+
+bool Clustering::LoadSnapshot(const std::string& filename, const uint64_t key)
+{
+	SnapshotReader in;
+	uint64_t num_clusters;
+	if (!in.Open(filename, key) || !in.Read(num_clusters))
+	{
+		return false;
+	}
+
+	std::vector<Cluster> state(num_clusters);
+	for (auto& cluster : state)
+	{
+		if (!in.ReadVector(cluster.point_idx) || !in.ReadVector(cluster.camera_idx.words))
 		{
-			std::cout << "Failed to create the directory for cluster " << i << std::endl;
+			std::cout << "Snapshot " << filename << " is truncated" << std::endl;
 			return false;
 		}
+	}
+	if (!in.Done())
+	{
+		std::cout << "Snapshot " << filename << " has trailing bytes" << std::endl;
+		return false;
+	}
+
+	clusters.swap(state);
+	modified.assign(clusters.size(), 1);
+	return true;
+}
+
+// Points are stored by their ID in the points file, which does not change when the sequence
+// grows, and neighbors in the order of the cameras of each cluster. The number of features and
+// the depth range of every image tell the next run which old images have changed.
+
+bool Clustering::SaveState(const std::string& filename, const uint64_t key) const
+{
+	SnapshotWriter out;
+	if (!out.Open(filename, key))
+	{
+		return false;
+	}
 
-		const std::string colmap_path = cluster_folder + "COLMAP/";
-		if (mkdir(colmap_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+	std::vector<int> num_features(data.images.size());
+	std::vector<float> depth_range(2 * data.images.size());
+	for (int uuid = 0; uuid < data.images.size(); uuid++)
+	{
+		num_features[uuid] = data.FeaturesEnd(uuid) - data.FeaturesBegin(uuid);
+		depth_range[2 * uuid] = data.images[uuid].min_depth;
+		depth_range[2 * uuid + 1] = data.images[uuid].max_depth;
+	}
+
+	out.Write<uint64_t>(data.images.size());
+	out.WriteVector(num_features);
+	out.WriteVector(depth_range);
+	out.Write<uint64_t>(clusters.size());
+
+	std::vector<int> ids, num_neighbors;
+	std::vector<Neighbor> neighbors;
+	for (const auto& cluster : clusters)
+	{
+		ids.clear();
+		for (const auto& p : cluster.point_idx)
 		{
-			std::cout << "Failed to create the COLMAP directory for cluster " << i << std::endl;
-			return false;
+			ids.push_back(data.point_ids[p]);
 		}
 
-		// std::cout << "Writing cameras file in COLMAP format..." << std::endl;
-		if (!WriteColmapCamerasFile(colmap_path, i))
+		num_neighbors.clear();
+		neighbors.clear();
+		for (const auto& uuid : cluster.camera_idx.ToVector())
 		{
-			std::cout << "Failed to write cameras file in COLMAP format for cluster " << i << std::endl;
-			return false;
+			const auto it = cluster.neighbors.find(uuid);
+			num_neighbors.push_back(it == cluster.neighbors.end() ? 0 : it->second.size());
+			if (it != cluster.neighbors.end())
+			{
+				neighbors.insert(neighbors.end(), it->second.begin(), it->second.end());
+			}
 		}
 
-		// std::cout << "Writing images file in COLMAP format..." << std::endl;
-		if (!WriteColmapImagesFile(colmap_path, i))
+		out.WriteVector(ids);
+		out.WriteVector(cluster.camera_idx.words);
+		out.WriteVector(num_neighbors);
+		out.WriteVector(neighbors);
+	}
+
+	return out.Close();
+}
+
+// Clusters whose points are no longer all visible, or with an image whose features or depth
+// range have changed (an old camera may see new points), are marked as modified, the others are not
+
+bool Clustering::LoadState(const std::string& filename, const uint64_t key, int& num_old_images)
+{
+	SnapshotReader in;
+	uint64_t num_images, num_clusters;
+	std::vector<int> num_features;
+	std::vector<float> depth_range;
+	if (!in.Open(filename, key) || !in.Read(num_images) || !in.ReadVector(num_features) || 
+		!in.ReadVector(depth_range) || !in.Read(num_clusters))
+	{
+		return false;
+	}
+
+	if (num_images > data.images.size())
+	{
+		std::cout << "The previous run has " << num_images << " images, more than the current " << data.images.size() << std::endl;
+		return false;
+	}
+	if (num_features.size() != num_images || depth_range.size() != 2 * num_images)
+	{
+		std::cout << "Snapshot " << filename << " is inconsistent" << std::endl;
+		return false;
+	}
+
+	std::vector<char> changed(num_images, 0);
+	for (int uuid = 0; uuid < num_images; uuid++)
+	{
+		changed[uuid] = num_features[uuid] != data.FeaturesEnd(uuid) - data.FeaturesBegin(uuid) || 
+						depth_range[2 * uuid] != data.images[uuid].min_depth || 
+						depth_range[2 * uuid + 1] != data.images[uuid].max_depth;
+	}
+
+	std::vector<Cluster> state(num_clusters);
+	std::vector<char> missing(num_clusters, 0);
+	std::vector<int> ids, num_neighbors;
+	std::vector<Neighbor> neighbors;
+
+	for (int i = 0; i < num_clusters; i++)
+	{
+		Cluster& cluster = state[i];
+		if (!in.ReadVector(ids) || !in.ReadVector(cluster.camera_idx.words) || 
+			!in.ReadVector(num_neighbors) || !in.ReadVector(neighbors))
 		{
-			std::cout << "Failed to write images file in COLMAP format for cluster " << i << std::endl;
+			std::cout << "Snapshot " << filename << " is truncated" << std::endl;
 			return false;
 		}
 
-		// std::cout << "Writing points file in COLMAP format..." << std::endl;
-		if (!WriteColmapPointsFile(colmap_path, i))
+		for (const auto& id : ids)
+		{
+			const auto it = std::lower_bound(data.point_ids.begin(), data.point_ids.end(), id);
+			if (it != data.point_ids.end() && *it == id)
+			{
+				cluster.point_idx.push_back(it - data.point_ids.begin());
+			}
+			else
+			{
+				missing[i] = 1;
+			}
+		}
+
+		const std::vector<int> cameras = cluster.camera_idx.ToVector();
+		if (cameras.size() != num_neighbors.size() || (!cameras.empty() && cameras.back() >= num_images))
 		{
-			std::cout << "Failed to write points file in COLMAP format for cluster " << i << std::endl;
+			std::cout << "Snapshot " << filename << " is inconsistent" << std::endl;
 			return false;
 		}
+		for (const auto& uuid : cameras)
+		{
+			if (changed[uuid])
+			{
+				missing[i] = 1;
+			}
+		}
+
+		size_t offset = 0;
+		for (int k = 0; k < cameras.size() && offset + num_neighbors[k] <= neighbors.size(); k++)
+		{
+			cluster.neighbors[cameras[k]].assign(neighbors.begin() + offset, neighbors.begin() + offset + num_neighbors[k]);
+			offset += num_neighbors[k];
+		}
+
+		cluster.camera_idx.words.resize((data.images.size() + 63) / 64, 0);
+	}
+	if (!in.Done())
+	{
+		std::cout << "Snapshot " << filename << " has trailing bytes" << std::endl;
+		return false;
 	}
 
+	clusters.swap(state);
+	modified.swap(missing);
+	num_old_images = num_images;
 	return true;
 }
 
-bool Clustering::WriteClustersFiles(const std::string& output_path, const int num_neighbors)
+void Clustering::ComputeNeighbors(const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0, const bool inverted_index)
 {
-	for (int i = 0; i < clusters.size(); i++)
+	ThreadPool pool(data.num_threads);
+
+	const ViewSelectionWeights weights(sigma_0, sigma_1, theta_0);
+	std::vector<std::vector<int>> camera_points;
+	std::vector<std::vector<int>> cluster_cameras;
+	std::vector<std::vector<int>> candidates;
+	std::vector<std::vector<std::unordered_map<uint64_t, float>>> chunk_scores; // Per cluster and chunk of candidates
+
+	if (inverted_index)
 	{
-		const std::string cluster_folder = output_path + "cluster_" + std::to_string(i) + "/";
+		// Points seen by each camera of the modified clusters, in increasing order as the features
+		// of every image are sorted by point
 
-		if (!WriteCamerasFiles(cluster_folder, i))
+		camera_points.resize(data.images.size());
+		for (int i = 0; i < clusters.size(); i++)
 		{
-			std::cout << "Failed to write cameras files for cluster " << i << std::endl;
-			return false;
+			if (!modified[i])
+			{
+				continue;
+			}
+			for (const auto& uuid : clusters[i].camera_idx.ToVector())
+			{
+				if (camera_points[uuid].empty())
+				{
+					for (const Feature* f = data.FeaturesBegin(uuid); f != data.FeaturesEnd(uuid); f++)
+					{
+						camera_points[uuid].push_back(f->point_idx);
+					}
+				}
+			}
+		}
+
+		// Cameras and candidate points of every cluster, then one task per chunk of candidates, so
+		// that a dense cluster is spread over all workers. Every chunk has its own score table and
+		// the tables are merged in chunk order. Chunks do not depend on the number of threads.
+
+		const int points_per_task = 4096;
+		candidates.resize(clusters.size());
+		chunk_scores.resize(clusters.size());
+		cluster_cameras.resize(clusters.size());
+
+		for (int i = 0; i < clusters.size(); i++)
+		{
+			if (!modified[i])
+			{
+				continue;
+			}
+			pool.Submit([&, i]()
+			{
+				cluster_cameras[i] = clusters[i].camera_idx.ToVector();
+				for (const auto& uuid : cluster_cameras[i])
+				{
+					candidates[i].insert(candidates[i].end(), camera_points[uuid].begin(), camera_points[uuid].end());
+				}
+				std::sort(candidates[i].begin(), candidates[i].end());
+				candidates[i].erase(std::unique(candidates[i].begin(), candidates[i].end()), candidates[i].end());
+			});
 		}
+		pool.Wait();
 
-		if (!WriteNeighborsFile(cluster_folder, i, num_neighbors))
+		for (int i = 0; i < clusters.size(); i++)
 		{
-			std::cout << "Failed to write neighbors file for cluster " << i << std::endl;
-			return false;
+			chunk_scores[i].resize((candidates[i].size() + points_per_task - 1) / points_per_task);
+			for (int k = 0; k < chunk_scores[i].size(); k++)
+			{
+				const size_t begin = static_cast<size_t>(k) * points_per_task;
+				const size_t end = std::min(candidates[i].size(), begin + points_per_task);
+				pool.Submit([&, i, k, begin, end]()
+				{
+					ScopedTimer timer("neighbors_chunk");
+					AccumulateTrackScores(cluster_cameras[i], candidates[i].data() + begin, candidates[i].data() + end, 
+										  weights, chunk_scores[i][k]);
+				});
+			}
 		}
+		pool.Wait();
 
-		if (!WriteImages(cluster_folder, i))
+		for (int i = 0; i < clusters.size(); i++)
 		{
-			std::cout << "Failed to write images for cluster " << i << std::endl;
-			return false;
+			if (!modified[i])
+			{
+				continue;
+			}
+			pool.Submit([&, i]()
+			{
+				ScopedTimer timer("neighbors_cluster");
+				SelectNeighborsFromTracks(i, cluster_cameras[i], chunk_scores[i], num_neighbors);
+			});
+		}
+	}
+	else
+	{
+		// One task per (cluster, reference camera), so that large clusters are spread over all workers.
+		// Map entries are created upfront, tasks only fill their own vector.
+
+		cluster_cameras.resize(clusters.size());
+		for (int i = 0; i < clusters.size(); i++)
+		{
+			if (!modified[i])
+			{
+				continue;
+			}
+			cluster_cameras[i] = clusters[i].camera_idx.ToVector();
+			for (const auto& ref : cluster_cameras[i])
+			{
+				clusters[i].neighbors[ref];
+				pool.Submit([=, &cluster_cameras, &weights]()
+				{
+					ScopedTimer timer("neighbors_reference");
+					ComputeNeighborsForReference(i, ref, cluster_cameras[i], num_neighbors, weights);
+				});
+			}
+		}
+	}
+	pool.Wait();
+}
+
+// Clusters are written in parallel, one task per cluster. Every worker formats into its own
+// OutputBuffer, which is reused for all the files it writes.
+
+bool Clustering::WriteColmapFiles(const std::string& output_path, const bool binary)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	RemoveClusterFolders(output_path);
+
+	ThreadPool pool(data.num_threads);
+	std::vector<OutputBuffer> buffers(pool.NumThreads());
+	std::vector<char> success(clusters.size(), 1); // Clusters that are not modified are kept as they are
+
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		if (!modified[i])
+		{
+			continue;
+		}
+		pool.Submit([&, i]()
+		{
+			ScopedTimer timer("write_colmap_cluster");
+			success[i] = WriteColmapCluster(output_path, i, binary, buffers[pool.WorkerId()]);
+		});
+	}
+	pool.Wait();
+
+	ReportThroughput(buffers, start);
+
+	return std::find(success.begin(), success.end(), 0) == success.end();
+}
+
+bool Clustering::WriteColmapCluster(const std::string& output_path, const int i, const bool binary, OutputBuffer& out)
+{
+	const std::string cluster_folder = output_path + "cluster_" + std::to_string(i) + "/";
+	if (mkdir(cluster_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+	{
+		std::cout << "Failed to create the directory for cluster " << i << std::endl;
+		return false;
+	}
+
+	const std::string colmap_path = cluster_folder + "COLMAP/";
+	if (mkdir(colmap_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+	{
+		std::cout << "Failed to create the COLMAP directory for cluster " << i << std::endl;
+		return false;
+	}
+
+	if (!(binary ? WriteColmapCamerasBinary(colmap_path, i, out) : WriteColmapCamerasFile(colmap_path, i, out)))
+	{
+		std::cout << "Failed to write cameras file in COLMAP format for cluster " << i << std::endl;
+		return false;
+	}
+
+	if (!(binary ? WriteColmapImagesBinary(colmap_path, i, out) : WriteColmapImagesFile(colmap_path, i, out)))
+	{
+		std::cout << "Failed to write images file in COLMAP format for cluster " << i << std::endl;
+		return false;
+	}
+
+	if (!(binary ? WriteColmapPointsBinary(colmap_path, i, out) : WriteColmapPointsFile(colmap_path, i, out)))
+	{
+		std::cout << "Failed to write points file in COLMAP format for cluster " << i << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool Clustering::WriteClustersFiles(const std::string& output_path, const int num_neighbors)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	ThreadPool pool(data.num_threads);
+	std::vector<OutputBuffer> buffers(pool.NumThreads());
+	std::vector<char> success(clusters.size(), 1); // Clusters that are not modified are kept as they are
+
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		if (!modified[i])
+		{
+			continue;
 		}
+		pool.Submit([&, i]()
+		{
+			ScopedTimer timer("write_cluster_files");
+			success[i] = WriteClusterFiles(output_path, i, num_neighbors, buffers[pool.WorkerId()]);
+		});
+	}
+	pool.Wait();
+
+	ReportThroughput(buffers, start);
+
+	return std::find(success.begin(), success.end(), 0) == success.end();
+}
+
+bool Clustering::WriteClusterFiles(const std::string& output_path, const int i, const int num_neighbors, OutputBuffer& out)
+{
+	const std::string cluster_folder = output_path + "cluster_" + std::to_string(i) + "/";
+
+	if (!WriteCamerasFiles(cluster_folder, i, out))
+	{
+		std::cout << "Failed to write cameras files for cluster " << i << std::endl;
+		return false;
+	}
+
+	if (!WriteNeighborsFile(cluster_folder, i, num_neighbors, out))
+	{
+		std::cout << "Failed to write neighbors file for cluster " << i << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Removes a folder and everything inside it, false if the folder did not exist
+
+bool Clustering::RemoveFolder(const std::string& path)
+{
+	const auto remove_entry = [](const char* name, const struct stat*, int, struct FTW*) { return remove(name); };
+	return nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+// Folders of a previous run that are about to be written again. When every cluster is written,
+// all the cluster_* folders are removed, so none is left from a run with more clusters. An
+// incremental run keeps the indices of the old clusters and only removes the modified ones.
+
+void Clustering::RemoveClusterFolders(const std::string& output_path) const
+{
+	if (std::find(modified.begin(), modified.end(), 0) == modified.end())
+	{
+		DIR* dir = opendir(output_path.c_str());
+		if (dir == nullptr)
+		{
+			return;
+		}
+
+		std::vector<std::string> folders;
+		for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+		{
+			if (strncmp(entry->d_name, "cluster_", 8) == 0)
+			{
+				folders.push_back(output_path + entry->d_name);
+			}
+		}
+		closedir(dir);
+
+		for (const auto& folder : folders)
+		{
+			RemoveFolder(folder);
+		}
+		return;
+	}
+
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		if (modified[i])
+		{
+			RemoveFolder(output_path + "cluster_" + std::to_string(i) + "/");
+		}
+	}
+}
+
+// Throughput of all the files written through the buffers since start
+
+void Clustering::ReportThroughput(const std::vector<OutputBuffer>& buffers, const std::chrono::steady_clock::time_point& start)
+{
+	size_t bytes = 0;
+	for (const auto& b : buffers)
+	{
+		bytes += b.BytesWritten();
+	}
+
+	Profiler::Get().Count("bytes_written", bytes);
+
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double megabytes = bytes / (1024.0 * 1024.0);
+	std::cout << "Wrote " << megabytes << " MB in " << elapsed << " s (" << megabytes / elapsed 
+			  << " MB/s, " << buffers.size() << " threads)" << std::endl;
+}
+
+void Clustering::PrintReport()
+{
+	int cam_count = 0;
+	int point_count = 0;
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		const int num_points = clusters[i].point_idx.size();
+		const int num_cams = clusters[i].camera_idx.Count();
+		std::cout << "Cluster " << i << " has " << num_points << " points and " << num_cams << " cameras" << std::endl;
+		cam_count += num_cams;
+		point_count += num_points;
+	}
+	std::cout << std::endl << "Total points: " << point_count << std::endl;
+	std::cout << "Total cameras: " << cam_count << std::endl << std::endl;
+}
+
+// Bounds of x and z in a single parallel pass, every thread reduces its own chunk
+
+void Clustering::ComputePointCloudRange(const std::vector<int>& point_idx)
+{
+	const int num_threads = std::max(1, std::min<int>(data.num_threads, point_idx.size() / 65536));
+	const float inf = std::numeric_limits<float>::infinity();
+	std::vector<float> min_x(num_threads, inf), max_x(num_threads, -inf);
+	std::vector<float> min_z(num_threads, inf), max_z(num_threads, -inf);
+
+	const auto reduce_range = [&](const int t, const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			const int p = point_idx[i];
+			min_x[t] = std::min(min_x[t], data.points.x[p]);
+			max_x[t] = std::max(max_x[t], data.points.x[p]);
+			min_z[t] = std::min(min_z[t], data.points.z[p]);
+			max_z[t] = std::max(max_z[t], data.points.z[p]);
+		}
+	};
+	ParallelFor(point_idx.size(), num_threads, reduce_range);
+
+	x_min = *std::min_element(min_x.begin(), min_x.end());
+	x_max = *std::max_element(max_x.begin(), max_x.end());
+	z_min = *std::min_element(min_z.begin(), min_z.end());
+	z_max = *std::max_element(max_z.begin(), max_z.end());
+}
+
+// Counting sort of the points by block: every thread builds the histogram of its chunk, the
+// prefix sums give each thread its write offset inside every block, and a single scatter pass
+// fills the point lists, which are allocated once at their final size. Chunks are contiguous,
+// so every list keeps the points in increasing order.
+
+void Clustering::AssignPointsToBlock(const std::vector<int>& point_idx, const int block_size, const int num_blocks_x)
+{
+	const int num_blocks = clusters.size();
+	const int num_blocks_z = num_blocks / num_blocks_x;
+	const int num_threads = std::max(1, std::min<int>(data.num_threads, point_idx.size() / 65536));
+
+	// Blocks start at the corner of the range of the given points, which is away from the origin
+	// for the new points of an incremental run. Points on the upper edge go to the last block.
+
+	const auto block_of = [&](const int i)
+	{
+		const int x = (data.points.x[i] - x_min) / block_size;
+		const int z = (data.points.z[i] - z_min) / block_size;
+		return std::min(z, num_blocks_z - 1) * num_blocks_x + std::min(x, num_blocks_x - 1);
+	};
+
+	std::vector<int> point_block(point_idx.size());
+	std::vector<std::vector<int>> counts(num_threads, std::vector<int>(num_blocks, 0));
+
+	const auto count_points = [&](const int t, const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			point_block[i] = block_of(point_idx[i]);
+			counts[t][point_block[i]]++;
+		}
+	};
+	ParallelFor(point_idx.size(), num_threads, count_points);
+
+	for (int b = 0; b < num_blocks; b++)
+	{
+		int offset = 0;
+		for (int t = 0; t < num_threads; t++)
+		{
+			const int c = counts[t][b];
+			counts[t][b] = offset;
+			offset += c;
+		}
+		clusters[b].point_idx.resize(offset);
+	}
+
+	const auto scatter_points = [&](const int t, const size_t begin, const size_t end)
+	{
+		std::vector<int>& offsets = counts[t];
+		for (size_t i = begin; i < end; i++)
+		{
+			const int b = point_block[i];
+			clusters[b].point_idx[offsets[b]++] = point_idx[i];
+		}
+	};
+	ParallelFor(point_idx.size(), num_threads, scatter_points);
+}
+
+// 8-neighborhood of every grid block
+
+void Clustering::ComputeGridAdjacency(const int num_blocks_x)
+{
+	const int num_blocks_z = clusters.size() / num_blocks_x;
+	adjacency.assign(clusters.size(), std::vector<int>());
+
+	for (int z = 0; z < num_blocks_z; z++)
+	{
+		for (int x = 0; x < num_blocks_x; x++)
+		{
+			for (int dz = -1; dz <= 1; dz++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					if ((dx != 0 || dz != 0) && 
+						z + dz >= 0 && z + dz < num_blocks_z && 
+						x + dx >= 0 && x + dx < num_blocks_x)
+					{
+						adjacency[z * num_blocks_x + x].push_back((z + dz) * num_blocks_x + x + dx);
+					}
+				}
+			}
+		}
+	}
+}
+
+// Hierarchical alternative to the grid: the XZ extent is split recursively in four quadrants
+// until every node fits the point and camera budgets (0 means no limit), so that clusters have
+// a predictable cost. Non-empty leaves become the blocks, in depth-first order.
+
+void Clustering::BuildQuadtree(const std::vector<int>& point_idx, const int max_points, const int max_cameras, const float max_distance)
+{
+	clusters.clear();
+	std::vector<QuadtreeNode> nodes;
+	const int root = SplitQuadtreeNode(point_idx, {{ x_min, z_min, x_max, z_max }}, 0, max_points, max_cameras, max_distance, nodes);
+
+	adjacency.assign(clusters.size(), std::vector<int>());
+	ConnectQuadtreeNodes(nodes, root, -1, 0);
+	for (auto& neighbors : adjacency)
+	{
+		std::sort(neighbors.begin(), neighbors.end());
+		neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+	}
+}
+
+// Returns the index of the node in nodes
+
+int Clustering::SplitQuadtreeNode(const std::vector<int>& point_idx, 
+								  const std::array<float, 4>& box, 
+								  const int depth,
+								  const int max_points, 
+								  const int max_cameras, 
+								  const float max_distance,
+								  std::vector<QuadtreeNode>& nodes)
+{
+	const int max_depth = 16; // Stops on points that cannot be separated
+
+	const bool too_many_points = max_points > 0 && point_idx.size() > max_points;
+	const bool too_many_cameras = !too_many_points && max_cameras > 0 && 
+								  CollectCameras(point_idx, max_distance).Count() > max_cameras;
+
+	const int node = nodes.size();
+	nodes.push_back({ -1, { -1, -1, -1, -1 } });
+
+	if ((!too_many_points && !too_many_cameras) || depth == max_depth)
+	{
+		nodes[node].block = clusters.size();
+		clusters.push_back(Cluster());
+		clusters.back().point_idx = point_idx;
+		return node;
+	}
+
+	// Quadrants in row-major order, points keep their relative order
+
+	const float x_mid = 0.5f * (box[0] + box[2]);
+	const float z_mid = 0.5f * (box[1] + box[3]);
+	std::vector<int> children[4];
+	for (const auto& p : point_idx)
+	{
+		const int q = 2 * (data.points.z[p] >= z_mid) + (data.points.x[p] >= x_mid);
+		children[q].push_back(p);
+	}
+
+	const std::array<float, 4> child_boxes[4] = { {{ box[0], box[1], x_mid, z_mid }},
+												  {{ x_mid, box[1], box[2], z_mid }},
+												  {{ box[0], z_mid, x_mid, box[3] }},
+												  {{ x_mid, z_mid, box[2], box[3] }} };
+
+	for (int q = 0; q < 4; q++)
+	{
+		if (!children[q].empty())
+		{
+			const int child = SplitQuadtreeNode(children[q], child_boxes[q], depth + 1, max_points, max_cameras, max_distance, nodes);
+			nodes[node].children[q] = child;
+		}
+	}
+	return node;
+}
+
+// Leaves are adjacent when their boxes touch, corners included as in the grid. They are found
+// from the tree in linear time, by following every boundary between two nodes down to the
+// leaves on both of its sides. side is the position of b relative to a: 0 for the inside of a
+// (b unused), 1 to the right (+x), 2 above (+z), 3 at the top right corner and 4 at the bottom
+// right corner. A leaf stands for all its quadrants.
+
+void Clustering::ConnectQuadtreeNodes(const std::vector<QuadtreeNode>& nodes, const int a, const int b, const int side)
+{
+	if (a < 0 || (side > 0 && b < 0))
+	{
+		return;
+	}
+
+	const auto child = [&nodes](const int n, const int q) { return nodes[n].block >= 0 ? n : nodes[n].children[q]; };
+
+	if (side == 0)
+	{
+		if (nodes[a].block >= 0)
+		{
+			return;
+		}
+		const int* c = nodes[a].children;
+		for (int q = 0; q < 4; q++)
+		{
+			ConnectQuadtreeNodes(nodes, c[q], -1, 0);
+		}
+		ConnectQuadtreeNodes(nodes, c[0], c[1], 1);
+		ConnectQuadtreeNodes(nodes, c[2], c[3], 1);
+		ConnectQuadtreeNodes(nodes, c[0], c[2], 2);
+		ConnectQuadtreeNodes(nodes, c[1], c[3], 2);
+		ConnectQuadtreeNodes(nodes, c[0], c[3], 3);
+		ConnectQuadtreeNodes(nodes, c[2], c[1], 4);
+		return;
+	}
+
+	const bool a_leaf = nodes[a].block >= 0;
+	const bool b_leaf = nodes[b].block >= 0;
+	if (a_leaf && b_leaf)
+	{
+		adjacency[nodes[a].block].push_back(nodes[b].block);
+		adjacency[nodes[b].block].push_back(nodes[a].block);
+		return;
+	}
+
+	if (side == 1)
+	{
+		ConnectQuadtreeNodes(nodes, child(a, 1), child(b, 0), 1);
+		ConnectQuadtreeNodes(nodes, child(a, 3), child(b, 2), 1);
+		if (!a_leaf && !b_leaf)
+		{
+			ConnectQuadtreeNodes(nodes, child(a, 1), child(b, 2), 3);
+			ConnectQuadtreeNodes(nodes, child(a, 3), child(b, 0), 4);
+		}
+	}
+	else if (side == 2)
+	{
+		ConnectQuadtreeNodes(nodes, child(a, 2), child(b, 0), 2);
+		ConnectQuadtreeNodes(nodes, child(a, 3), child(b, 1), 2);
+		if (!a_leaf && !b_leaf)
+		{
+			ConnectQuadtreeNodes(nodes, child(a, 2), child(b, 1), 3);
+			ConnectQuadtreeNodes(nodes, child(b, 0), child(a, 3), 4);
+		}
+	}
+	else if (side == 3)
+	{
+		ConnectQuadtreeNodes(nodes, child(a, 3), child(b, 0), 3);
+	}
+	else
+	{
+		ConnectQuadtreeNodes(nodes, child(a, 1), child(b, 2), 4);
+	}
+}
+
+// Undersized blocks (fewer than min_size points, or cameras if by_cameras) are merged with
+// neighbors on a union-find over the blocks, in rounds. In every round each undersized group
+// picks its smallest neighboring group, comparing sizes from the start of the round and
+// breaking ties by the lowest block index, then all picks are applied. Rounds go on until no
+// undersized group has a neighbor left, so isolated groups are kept rather than dropped. The
+// picks only read the state at the start of the round, so the result does not depend on the
+// scan order or on the number of threads. Groups become the new blocks, ordered by their
+// lowest block index, with their points in increasing order and the union of their cameras.
+
+void Clustering::MergeUndersizedBlocks(const int min_size, const bool by_cameras)
+{
+	const int num_blocks = clusters.size();
+	DisjointSets sets(num_blocks);
+
+	// Per group, valid at the root: size, number of points and lowest block index
+
+	std::vector<int> size(num_blocks), num_points(num_blocks), label(num_blocks);
+	for (int i = 0; i < num_blocks; i++)
+	{
+		num_points[i] = clusters[i].point_idx.size();
+		size[i] = by_cameras ? clusters[i].camera_idx.Count() : num_points[i];
+		label[i] = i;
+	}
+
+	const auto undersized = [&](const int r) { return num_points[r] > 0 && size[r] < min_size; };
+
+	std::vector<int> root(num_blocks);
+	std::vector<int> best(num_blocks);
+
+	while (true)
+	{
+		for (int i = 0; i < num_blocks; i++)
+		{
+			root[i] = sets.Find(i);
+		}
+
+		// Smallest neighboring group seen from every block of an undersized group
+
+		const auto pick_neighbors = [&](const int, const size_t begin, const size_t end)
+		{
+			for (size_t i = begin; i < end; i++)
+			{
+				best[i] = -1;
+				const int r = root[i];
+				if (!undersized(r))
+				{
+					continue;
+				}
+				for (const auto& j : adjacency[i])
+				{
+					const int s = root[j];
+					if (s != r && num_points[s] > 0 && 
+						(best[i] == -1 || std::make_pair(size[s], label[s]) < std::make_pair(size[best[i]], label[best[i]])))
+					{
+						best[i] = s;
+					}
+				}
+			}
+		};
+		ParallelFor(num_blocks, data.num_threads, pick_neighbors);
+
+		// Reduce to one pick per group
+
+		std::vector<int> group_best(num_blocks, -1);
+		for (int i = 0; i < num_blocks; i++)
+		{
+			const int r = root[i];
+			const int s = best[i];
+			if (s != -1 && (group_best[r] == -1 || 
+				std::make_pair(size[s], label[s]) < std::make_pair(size[group_best[r]], label[group_best[r]])))
+			{
+				group_best[r] = s;
+			}
+		}
+
+		std::vector<std::pair<int, int>> merges;
+		for (int r = 0; r < num_blocks; r++)
+		{
+			if (group_best[r] != -1)
+			{
+				merges.push_back(std::make_pair(r, group_best[r]));
+			}
+		}
+		if (merges.empty())
+		{
+			break;
+		}
+
+		for (const auto& m : merges)
+		{
+			const int a = sets.Find(m.first);
+			const int b = sets.Find(m.second);
+			if (a == b)
+			{
+				continue;
+			}
+
+			const int r = sets.Union(a, b);
+			const int other = (r == a) ? b : a;
+			num_points[r] += num_points[other];
+			label[r] = std::min(label[r], label[other]);
+			if (by_cameras)
+			{
+				clusters[r].camera_idx.Merge(clusters[other].camera_idx);
+				size[r] = clusters[r].camera_idx.Count();
+			}
+			else
+			{
+				size[r] = num_points[r];
+			}
+		}
+	}
+
+	// Gather groups into the new blocks, and their adjacency
+
+	std::vector<int> group(num_blocks, -1);
+	std::vector<int> roots_by_label;
+	for (int i = 0; i < num_blocks; i++)
+	{
+		root[i] = sets.Find(i);
+		if (label[root[i]] == i)
+		{
+			group[root[i]] = roots_by_label.size();
+			roots_by_label.push_back(root[i]);
+		}
+	}
+
+	std::vector<Cluster> merged(roots_by_label.size());
+	std::vector<std::vector<int>> merged_adjacency(roots_by_label.size());
+	for (int i = 0; i < num_blocks; i++)
+	{
+		const int g = group[root[i]];
+		merged[g].point_idx.insert(merged[g].point_idx.end(), clusters[i].point_idx.begin(), clusters[i].point_idx.end());
+		for (const auto& j : adjacency[i])
+		{
+			if (group[root[j]] != g)
+			{
+				merged_adjacency[g].push_back(group[root[j]]);
+			}
+		}
+	}
+
+	for (int g = 0; g < merged.size(); g++)
+	{
+		std::sort(merged[g].point_idx.begin(), merged[g].point_idx.end());
+		merged[g].camera_idx = std::move(clusters[roots_by_label[g]].camera_idx);
+		std::sort(merged_adjacency[g].begin(), merged_adjacency[g].end());
+		merged_adjacency[g].erase(std::unique(merged_adjacency[g].begin(), merged_adjacency[g].end()), merged_adjacency[g].end());
+	}
+
+	clusters.swap(merged);
+	adjacency.swap(merged_adjacency);
+}
+
+// Cameras that see at least one of the given points closer than max_distance
+
+CameraSet Clustering::CollectCameras(const std::vector<int>& point_idx, const float max_distance) const
+{
+	CameraSet cameras;
+	cameras.Resize(data.images.size());
+	for (const auto& p : point_idx)
+	{
+		for (const auto* cam = data.TrackBegin(p); cam != data.TrackEnd(p); cam++)
+		{
+			if (data.GetDepth(cam->first, cam->second) < max_distance)
+			{
+				cameras.Insert(cam->first);
+			}
+		}
+	}
+	return cameras;
+}
+
+// A camera belongs to a cluster if it sees one of its points closer than max_distance. Depths
+// come from the cache filled by ComputeDepthRange, so no point is transformed again here. The
+// point lists of all clusters are split evenly among threads: each thread collects the cameras
+// of its current cluster in a local set and merges it when it moves to the next cluster.
+
+void Clustering::AssignCamerasToBlock(const float max_distance)
+{
+	// Empty blocks of the grid keep an empty set instead of a bitset over all the UUIDs
+
+	const int num_uuids = data.images.size();
+	std::vector<size_t> cluster_begin(clusters.size() + 1, 0);
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		if (clusters[i].point_idx.empty())
+		{
+			clusters[i].camera_idx.words.clear();
+		}
+		else
+		{
+			clusters[i].camera_idx.Resize(num_uuids);
+		}
+		cluster_begin[i + 1] = cluster_begin[i] + clusters[i].point_idx.size();
+	}
+
+	std::mutex merge_mutex;
+
+	const auto assign_cameras = [&](const int, const size_t begin, const size_t end)
+	{
+		CameraSet local;
+		local.Resize(num_uuids);
+
+		int i = std::upper_bound(cluster_begin.begin(), cluster_begin.end(), begin) - cluster_begin.begin() - 1;
+		for (size_t j = begin; j < end; i++)
+		{
+			bool written = false;
+			const size_t last = std::min(end, cluster_begin[i + 1]);
+			for (; j < last; j++)
+			{
+				const int p = clusters[i].point_idx[j - cluster_begin[i]];
+				for (const auto* cam = data.TrackBegin(p); cam != data.TrackEnd(p); cam++)
+				{
+					if (data.GetDepth(cam->first, cam->second) < max_distance)
+					{
+						local.Insert(cam->first);
+						written = true;
+					}
+				}
+			}
+
+			if (written)
+			{
+				std::lock_guard<std::mutex> lock(merge_mutex);
+				clusters[i].camera_idx.Merge(local);
+				local.Clear();
+			}
+		}
+	};
+	ParallelFor(cluster_begin.back(), data.num_threads, assign_cameras);
+}
+
+// Merging may leave clusters with more than max_points points or max_cameras cameras (and the
+// grid never bounds them), so these are split in two along the principal axis of their points,
+// recursively, and cameras are assigned again to every child. Children take the place of their
+// parent in the list. A budget of 0 means no limit.
+
+void Clustering::SplitOversizedClusters(const int max_points, const int max_cameras, const float max_distance)
+{
+	std::vector<Cluster> result;
+	int num_split = 0;
+	int num_kept = 0;
+	const int num_clusters = clusters.size();
+
+	for (auto& c : clusters)
+	{
+		if (!IsOversized(c.point_idx, c.camera_idx, max_points, max_cameras) || c.point_idx.empty())
+		{
+			result.push_back(std::move(c));
+		}
+		else
+		{
+			num_split++;
+			const int first = result.size();
+			SplitAlongPrincipalAxis(c.point_idx, c.camera_idx, max_points, max_cameras, max_distance, result);
+			num_kept += CountUnsplittable(result, first, max_cameras);
+		}
+	}
+	clusters.swap(result);
+
+	if (num_split > 0)
+	{
+		std::cout << "Split " << num_split << " clusters over the budget of " << max_points << " points and " 
+				  << max_cameras << " cameras, " << clusters.size() - num_clusters + num_split << " clusters created" << std::endl;
+	}
+	if (num_kept > 0)
+	{
+		std::cout << "Warning: " << num_kept << " clusters with a single point are seen by more than " 
+				  << max_cameras << " cameras, they are kept" << std::endl;
+	}
+}
+
+// Leaves of a split (from index first on) that still have too many cameras, which happens only
+// when a single point is seen by more than max_cameras cameras
+
+int Clustering::CountUnsplittable(const std::vector<Cluster>& result, const int first, const int max_cameras)
+{
+	int count = 0;
+	for (int k = first; k < result.size(); k++)
+	{
+		if (max_cameras > 0 && result[k].camera_idx.Count() > max_cameras)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+bool Clustering::IsOversized(const std::vector<int>& point_idx, const CameraSet& camera_idx, const int max_points, const int max_cameras)
+{
+	return (max_points > 0 && point_idx.size() > max_points) || (max_cameras > 0 && camera_idx.Count() > max_cameras);
+}
+
+void Clustering::SplitAlongPrincipalAxis(const std::vector<int>& point_idx, 
+										 const CameraSet& camera_idx, 
+										 const int max_points, 
+										 const int max_cameras, 
+										 const float max_distance, 
+										 std::vector<Cluster>& result)
+{
+	if (!IsOversized(point_idx, camera_idx, max_points, max_cameras) || point_idx.size() < 2)
+	{
+		result.push_back(Cluster());
+		result.back().point_idx = point_idx;
+		result.back().camera_idx = camera_idx;
+		return;
+	}
+
+	// Principal axis of the points in the XZ plane, the plane in which blocks are built
+
+	double mean_x = 0.0, mean_z = 0.0;
+	for (const auto& p : point_idx)
+	{
+		mean_x += data.points.x[p];
+		mean_z += data.points.z[p];
+	}
+	mean_x /= point_idx.size();
+	mean_z /= point_idx.size();
+
+	double c_xx = 0.0, c_xz = 0.0, c_zz = 0.0;
+	for (const auto& p : point_idx)
+	{
+		const double dx = data.points.x[p] - mean_x;
+		const double dz = data.points.z[p] - mean_z;
+		c_xx += dx * dx;
+		c_xz += dx * dz;
+		c_zz += dz * dz;
+	}
+	const double angle = 0.5 * std::atan2(2.0 * c_xz, c_xx - c_zz);
+	const double axis_x = std::cos(angle);
+	const double axis_z = std::sin(angle);
+
+	// Split at the median projection (ties broken by index, so the result is deterministic)
+
+	std::vector<std::pair<double, int>> proj(point_idx.size());
+	for (int k = 0; k < point_idx.size(); k++)
+	{
+		const int p = point_idx[k];
+		proj[k] = std::make_pair(axis_x * data.points.x[p] + axis_z * data.points.z[p], p);
+	}
+	const int half = proj.size() / 2;
+	std::nth_element(proj.begin(), proj.begin() + half, proj.end());
+
+	std::vector<int> children[2];
+	for (int k = 0; k < proj.size(); k++)
+	{
+		children[k >= half].push_back(proj[k].second);
 	}
 
-	return true;
-}
-
-void Clustering::PrintReport()
-{
-	int cam_count = 0;
-	int point_count = 0;
-	for (int i = 0; i < clusters.size(); i++)
+	for (auto& child : children)
 	{
-		const int num_points = clusters[i].point_idx.size();
-		const int num_cams = clusters[i].camera_idx.size();
-		std::cout << "Cluster " << i << " has " << num_points << " points and " << num_cams << " cameras" << std::endl;
-		cam_count += num_cams;
-		point_count += num_points;
+		std::sort(child.begin(), child.end());
+		SplitAlongPrincipalAxis(child, CollectCameras(child, max_distance), max_points, max_cameras, max_distance, result);
 	}
-	std::cout << std::endl << "Total points: " << point_count << std::endl;
-	std::cout << "Total cameras: " << cam_count << std::endl << std::endl;
 }
 
-void Clustering::ComputePointCloudRange()
+// Inverted-index engine: every point seen by at least two cameras of the cluster adds its score
+// term to each pair of those cameras, so the work depends on the observations of each point 
+// rather than on the number of camera pairs. Points of a chunk are visited in increasing order,
+// as in the pairwise engine. Scores agree with it up to rounding only: rays are normalized and
+// angles go through the scalar AcosDegrees while the fused kernel batches them, and chunks are
+// summed separately, so the two engines may break ties differently.
+
+void Clustering::AccumulateTrackScores(const std::vector<int>& cameras, 
+									   const int* begin, 
+									   const int* end,
+									   const ViewSelectionWeights& weights, 
+									   std::unordered_map<uint64_t, float>& scores) const
 {
-	const auto cmp_x = [](const Point& p1, const Point& p2) { return p1.x < p2.x; }; 
-	const auto minmax_x = std::minmax_element(data.points.begin(), data.points.end(), cmp_x);
-	x_min = minmax_x.first->x;
-	x_max = minmax_x.second->x;
+	const int num_cams = cameras.size();
 
-	const auto cmp_z = [](const Point& p1, const Point& p2) { return p1.z < p2.z; }; 
-	const auto minmax_z = std::minmax_element(data.points.begin(), data.points.end(), cmp_z);
-	z_min = minmax_z.first->z;
-	z_max = minmax_z.second->z;
-}
+	// Sparse table of pairwise scores, keyed by the local indices (a, b) with a < b
 
-void Clustering::AssignPointsToBlock(const int block_size, const int num_blocks_x)
-{
-	for (int i = 0; i < data.points.size(); i++)
-	{		
-		const float x = std::floor((data.points[i].x + std::abs(x_min) + 0.01) / block_size);
-		const float z = std::floor((data.points[i].z + std::abs(z_min) + 0.01) / block_size);
-		const int idx = z * num_blocks_x + x;
-		clusters[idx].point_idx.push_back(i);
-	}
-}
+	std::vector<int> observers;
+	std::vector<std::array<float, 3>> rays;
+	uint64_t num_terms = 0;
 
-void Clustering::GroupByPoints(const int min_points, const int num_blocks_x)
-{
-	for (int i = 0; i < clusters.size(); i++)
+	for (const int* p = begin; p != end; p++)
 	{
-		if (clusters[i].point_idx.size() > 0 && clusters[i].point_idx.size() < min_points)
+		const Point point = data.points.Get(*p);
+
+		observers.clear();
+		for (const auto* cam = data.TrackBegin(*p); cam != data.TrackEnd(*p); cam++)
 		{
+			const auto it = std::lower_bound(cameras.begin(), cameras.end(), cam->first);
+			if (it != cameras.end() && *it == cam->first)
+			{
+				observers.push_back(it - cameras.begin());
+			}
+		}
 
-			std::vector<int> neighbors = { i - num_blocks_x, // Up 
-										   i + num_blocks_x, // Down
-										   i - num_blocks_x - 1, // Up-left 
-										   i - num_blocks_x + 1, // Up-right
-										   i + num_blocks_x - 1, // Down-left
-										   i + num_blocks_x + 1 }; // Down-right
+		// A camera may observe the same point twice, it must not become its own neighbor
 
-			if (i % num_blocks_x != 0)
-				neighbors.push_back(i - 1);
-			if (i % num_blocks_x != num_blocks_x - 1)
-				neighbors.push_back(i + 1);
+		std::sort(observers.begin(), observers.end());
+		observers.erase(std::unique(observers.begin(), observers.end()), observers.end());
+		if (observers.size() < 2)
+		{
+			continue;
+		}
 
-			bool isolated = true;
-			int smallest_idx = -1;
-			for (const auto& idx : neighbors)
-			{
-				if (idx >= 0 && idx < clusters.size())
-				{
-					if (clusters[idx].point_idx.size() > 0)
-					{
-						isolated = false;
-						if (smallest_idx == -1)
-						{
-							smallest_idx = idx;
-						}
-						else if (clusters[idx].point_idx.size() < clusters[smallest_idx].point_idx.size())
-						{
-							smallest_idx = idx;
-						}
-					}
-				}
-			}
+		// Unit rays from the point to each camera center
 
-			if (!isolated)
+		rays.resize(observers.size());
+		for (int k = 0; k < observers.size(); k++)
+		{
+			const float* t = data.images[cameras[observers[k]]].pose.t;
+			const float v[3] = { t[0] - point.x, t[1] - point.y, t[2] - point.z };
+			const float norm = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+			rays[k] = {{ v[0] / norm, v[1] / norm, v[2] / norm }};
+		}
+
+		for (int a = 0; a < observers.size(); a++)
+		{
+			for (int b = a + 1; b < observers.size(); b++)
 			{
-				clusters[smallest_idx].point_idx.insert(clusters[smallest_idx].point_idx.end(), 
-														clusters[i].point_idx.begin(), 
-														clusters[i].point_idx.end());
+				const float c = rays[a][0] * rays[b][0] + rays[a][1] * rays[b][1] + rays[a][2] * rays[b][2];
+				const float theta = AcosDegrees(c);
+				const uint64_t key = static_cast<uint64_t>(observers[a]) * num_cams + observers[b];
+				scores[key] += weights(theta);
 			}
-
-			clusters[i].point_idx.resize(0); // Set size to zero in order to remove later
 		}
+		num_terms += observers.size() * (observers.size() - 1) / 2;
 	}
+
+	Profiler::Get().Count("score_terms", num_terms);
 }
 
-void Clustering::AssignCamerasToBlock(const float max_distance)
+// Sums the tables of the chunks in order and keeps the top-k sources of every reference camera
+
+void Clustering::SelectNeighborsFromTracks(const int i, 
+										   const std::vector<int>& cameras, 
+										   const std::vector<std::unordered_map<uint64_t, float>>& chunk_scores, 
+										   const int num_neighbors)
 {
-	for (auto& c : clusters) // Cluster
+	const int num_cams = cameras.size();
+
+	std::unordered_map<uint64_t, float> scores;
+	for (const auto& chunk : chunk_scores)
 	{
-		for (const auto& p : c.point_idx) // Points in the cluster 
+		for (const auto& s : chunk)
 		{
-			for (const auto& cam : data.points[p].image_idx) // Cameras that see the point
-			{
-				const int uuid = cam.first;
-				const int sensor = uuid / data.num_frames;
-				const int frame = uuid - sensor * data.num_frames;
-
-				const Point p_cam = TransformPointFromWorldToCam(data.images[frame][sensor].R, 
-																 data.images[frame][sensor].t, 
-																 data.points[p]);
-				if (p_cam.z < max_distance)
-				{
-					c.camera_idx.insert(uuid); // This should remove duplicates automatically
-				}
-			}
+			scores[s.first] += s.second;
 		}
 	}
-}
 
-void Clustering::GroupByCameras(const int min_cameras, const int num_blocks_x)
-{
-	for (int i = 0; i < clusters.size(); i++)
+	Profiler::Get().Count("camera_pairs", scores.size());
+
+	std::vector<std::vector<Neighbor>> candidates_per_ref(num_cams);
+	for (const auto& s : scores)
 	{
-		if (clusters[i].camera_idx.size() > 0 && 
-			clusters[i].camera_idx.size() < min_cameras && 
-			clusters[i].point_idx.size() > 0)
+		const int a = s.first / num_cams;
+		const int b = s.first % num_cams;
+		if (s.second > 0.0f)
 		{
-			std::vector<int> neighbors = { i - num_blocks_x, // Up 
-										   i + num_blocks_x, // Down
-										   i - num_blocks_x - 1, // Up-left 
-										   i - num_blocks_x + 1, // Up-right
-										   i + num_blocks_x - 1, // Down-left
-										   i + num_blocks_x + 1 }; // Down-right
+			candidates_per_ref[a].push_back(Neighbor(cameras[b], s.second));
+			candidates_per_ref[b].push_back(Neighbor(cameras[a], s.second));
+		}
+	}
 
-			if (i % num_blocks_x != 0)
-				neighbors.push_back(i - 1);
-			if (i % num_blocks_x != num_blocks_x - 1)
-				neighbors.push_back(i + 1);
+	const auto lambda_uuid = [](const Neighbor& n1, const Neighbor& n2) { return n1.uuid < n2.uuid; };
+	const auto lambda_sort = [](const Neighbor& n1, const Neighbor& n2) { return n1.score > n2.score; };
 
-			int smallest_idx = -1;
-			for (const auto& idx : neighbors)
-			{
-				if (idx >= 0 && idx < clusters.size())
-				{
-					if (clusters[idx].point_idx.size() > 0 && clusters[idx].camera_idx.size() > 0)
-					{
-						if (smallest_idx == -1)
-						{
-							smallest_idx = idx;
-						}
-						else if (clusters[idx].camera_idx.size() < clusters[smallest_idx].camera_idx.size())
-						{
-							smallest_idx = idx;
-						}
-					}
-				}
-			}
+	for (int a = 0; a < num_cams; a++)
+	{
+		std::vector<Neighbor>& n = candidates_per_ref[a];
+		std::sort(n.begin(), n.end(), lambda_uuid); // Same input order as the pairwise engine
+		std::stable_sort(n.begin(), n.end(), lambda_sort); // Ties keep the order of the UUIDs
+		n.resize(num_neighbors);
+		clusters[i].neighbors[cameras[a]] = n;
+	}
+}
+
+void Clustering::ComputeNeighborsForReference(const int i, const int ref, const std::vector<int>& cameras, const int num_neighbors, const ViewSelectionWeights& weights)
+{
+	std::vector<Neighbor> n;
 
-			if (smallest_idx != -1)
+	for (const auto& src : cameras)
+	{
+		if (ref != src)
+		{
+			const float score = ComputeFusedScore(ref, src, weights);
+			if (score > 0.0f)
 			{
-				for (const auto& cam : clusters[i].camera_idx)
-				{
-					clusters[smallest_idx].camera_idx.insert(cam);
-				}
+				n.push_back(Neighbor(src, score));
 			}
-			// else
-			// {
-			// 	std::cout << "The cluster is isolated" << std::endl;
-			// 	std::cin.get();
-			// }
-
-			clusters[i].camera_idx.clear(); // Set size to zero in order to remove later
 		}
 	}
+
+	const auto lambda_sort = [](const Neighbor& n1, const Neighbor& n2) { return n1.score > n2.score; };
+	std::stable_sort(n.begin(), n.end(), lambda_sort); // Ties keep the order of the UUIDs
+	n.resize(num_neighbors);
+
+	clusters[i].neighbors.find(ref)->second = n;
+	Profiler::Get().Count("camera_pairs", cameras.size() - 1);
 }
 
-void Clustering::ComputeNeighborsForCluster(const int i, const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0)
+// Merge the two sorted feature lists and score the common points in the same pass. Matches are
+// buffered in fixed-size blocks on the stack, so that angles go through the batched kernel
+// without any heap allocation.
+
+float Clustering::ComputeFusedScore(const int ref, const int src, const ViewSelectionWeights& weights)
 {
-	for (const auto& ref : clusters[i].camera_idx)
+	const int block_size = 64;
+	float x[block_size], y[block_size], z[block_size], angles[block_size];
+	int n = 0;
+	float score = 0.0f;
+
+	const float* t_ref = data.images[ref].pose.t;
+	const float* t_src = data.images[src].pose.t;
+
+	const auto flush = [&]()
 	{
-		const int ref_sensor = ref / data.num_frames;
-		const int ref_frame = ref - ref_sensor * data.num_frames;
-		std::vector<Neighbor> n;
+		if (n == 0)
+		{
+			return;
+		}
+		ComputeTriangulationAngles(x, y, z, t_ref, t_src, angles, n);
+		for (int k = 0; k < n; k++)
+		{
+			score += weights(angles[k]);
+		}
+		n = 0;
+	};
+
+	const Feature* it1 = data.FeaturesBegin(ref);
+	const Feature* it2 = data.FeaturesBegin(src);
+	const Feature* end1 = data.FeaturesEnd(ref);
+	const Feature* end2 = data.FeaturesEnd(src);
 
-		for (const auto& src : clusters[i].camera_idx)
+	while (it1 != end1 && it2 != end2)
+	{
+		if (it1->point_idx < it2->point_idx)
+		{
+			++it1;
+		}
+		else if (it2->point_idx < it1->point_idx)
+		{
+			++it2;
+		}
+		else
 		{
-			if (ref != src)
+			const int p = it1->point_idx;
+			x[n] = data.points.x[p];
+			y[n] = data.points.y[p];
+			z[n] = data.points.z[p];
+			if (++n == block_size)
 			{
-				const int src_sensor = src / data.num_frames;
-				const int src_frame = src - src_sensor * data.num_frames;
-				std::vector<Feature> common_features;
-				std::set_intersection(data.images[ref_frame][ref_sensor].features.begin(), data.images[ref_frame][ref_sensor].features.end(),
-									  data.images[src_frame][src_sensor].features.begin(), data.images[src_frame][src_sensor].features.end(),
-									  back_inserter(common_features));
-
-				const float score = ComputeViewSelectionScore(common_features, ref_frame, ref_sensor, src_frame, src_sensor, sigma_0, sigma_1, theta_0);
-				if (score > 0.0f)
-				{
-					n.push_back(Neighbor(src, score));
-				}
+				flush();
 			}
+			++it1;
+			++it2;
 		}
-
-		const auto lambda_sort = [](const Neighbor& n1, const Neighbor& n2) { return n1.score > n2.score; };
-		std::sort(n.begin(), n.end(), lambda_sort);
-		n.resize(num_neighbors);
-
-		clusters[i].neighbors.insert(std::make_pair(ref, n));
 	}
+	flush();
+
+	return score;
 }
 
+// Reference implementation of the pairwise score, kept for BenchmarkScoreKernels
+
 float Clustering::ComputeViewSelectionScore(const std::vector<Feature>& idx, 
-												const int ref_frame,
-												const int ref_sensor,
-												const int src_frame,
-												const int src_sensor,
+												const int ref,
+												const int src,
 												const float sigma_0, 
 												const float sigma_1, 
 												const float theta_0)
 {
+	const int n = idx.size();
+	std::vector<float> x(n), y(n), z(n), angles(n);
+	for (int k = 0; k < n; k++)
+	{
+		const int p = idx[k].point_idx;
+		x[k] = data.points.x[p];
+		y[k] = data.points.y[p];
+		z[k] = data.points.z[p];
+	}
+
+	ComputeTriangulationAngles(x.data(), y.data(), z.data(), data.images[ref].pose.t, data.images[src].pose.t, angles.data(), n);
+
 	float score = 0.0f;
-	for (const auto& f : idx)
+	for (const auto& theta : angles)
 	{
-		float theta = ComputeTriangulationAngle(data.points[f.point_idx], 
-												data.images[ref_frame][ref_sensor].t, 
-												data.images[src_frame][src_sensor].t);
-		if (theta <= theta_0)
-		{
-			score += std::exp(- std::pow(theta - theta_0, 2) / (2 * std::pow(sigma_0, 2)));
-		}
-		else
-		{
-			score += std::exp(- std::pow(theta - theta_0, 2) / (2 * std::pow(sigma_1, 2)));
-		}
+		score += ComputeViewSelectionWeight(theta, sigma_0, sigma_1, theta_0);
 	}
 	return score;
 }
 
-bool Clustering::WriteNeighborsFile(const std::string& path, const int idx, const int num_neighbors)
+bool Clustering::WriteNeighborsFile(const std::string& path, const int idx, const int num_neighbors, OutputBuffer& out)
 {
 	const std::string filename = path + std::string("neighbors.txt");
 
-	std::ofstream neighbors_file_stream(filename, std::ios::out);
-	if (!neighbors_file_stream)
+	if (!out.Open(filename))
 	{
 		std::cout << "Failed to open neighbors file for cluster " << idx << std::endl;
 		return false;
@@ -362,23 +1589,24 @@ bool Clustering::WriteNeighborsFile(const std::string& path, const int idx, cons
 
 	Cluster& c = clusters[idx];
 
-	neighbors_file_stream << c.camera_idx.size() << std::endl;
+	const std::vector<int> cameras = c.camera_idx.ToVector();
+	out << cameras.size() << '\n';
 
-	for (const auto& i : c.camera_idx)
+	for (const auto& i : cameras)
 	{
-		neighbors_file_stream << i << std::endl;
-		neighbors_file_stream << c.neighbors[i].size() << " ";
+		out << i << '\n';
+		out << c.neighbors[i].size() << " ";
 		for (auto& n : c.neighbors[i])
 		{
-			neighbors_file_stream << n.uuid << " " << n.score << " ";
+			out << n.uuid << " " << n.score << " ";
 		}
-		neighbors_file_stream << std::endl;
+		out << '\n';
 	}
 
-	return true;
+	return out.Close();
 }
 
-bool Clustering::WriteCamerasFiles(const std::string& path, const int idx)
+bool Clustering::WriteCamerasFiles(const std::string& path, const int idx, OutputBuffer& out)
 {
 	const std::string cam_folder = path + "cameras/";
 	if (mkdir(cam_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
@@ -387,174 +1615,470 @@ bool Clustering::WriteCamerasFiles(const std::string& path, const int idx)
 		return false;
 	}
 
-	for (const auto& uuid : clusters[idx].camera_idx)
+	for (const auto& uuid : clusters[idx].camera_idx.ToVector())
 	{
-		const int sensor = uuid / data.num_frames;
-		const int frame = uuid - sensor * data.num_frames;
+		const Image& img = data.images[uuid];
+		const Intrinsics& K = data.intrinsics[data.GetSensor(uuid)];
+		const float* R = img.pose.R;
+		const float* t = img.pose.t;
 
 		char buffer[50];
 		sprintf(buffer, "%.8d.txt", uuid);
 		const std::string filename = cam_folder + std::string(buffer);
 
-		std::ofstream cameras_file_stream(filename, std::ios::out);
-		if (!cameras_file_stream)
+		if (!out.Open(filename))
 		{
 			std::cout << "Failed to open camera file " << uuid << " for cluster " << idx << std::endl;
 			return false;
 		}
 
-		cameras_file_stream << "extrinsic" << std::endl;
-		cameras_file_stream << data.images[frame][sensor].R(0,0) << " " << data.images[frame][sensor].R(0,1) << " " 
-							<< data.images[frame][sensor].R(0,2) << " " << data.images[frame][sensor].t(0,0) << std::endl
-							<< data.images[frame][sensor].R(1,0) << " " << data.images[frame][sensor].R(1,1) << " " 
-							<< data.images[frame][sensor].R(1,2) << " " << data.images[frame][sensor].t(1,0) << std::endl
-							<< data.images[frame][sensor].R(2,0) << " " << data.images[frame][sensor].R(2,1) << " " 
-							<< data.images[frame][sensor].R(2,2) << " " << data.images[frame][sensor].t(2,0) << std::endl
-							<< 0.0f << " " << 0.0f << " " << 0.0f << " " << 1.0f << " "
-							<< std::endl << std::endl;
+		out << "extrinsic" << '\n';
+		out << R[0] << " " << R[1] << " " << R[2] << " " << t[0] << '\n'
+			<< R[3] << " " << R[4] << " " << R[5] << " " << t[1] << '\n'
+			<< R[6] << " " << R[7] << " " << R[8] << " " << t[2] << '\n'
+			<< 0.0f << " " << 0.0f << " " << 0.0f << " " << 1.0f << " "
+			<< '\n' << '\n';
+
+		out << "intrinsic" << '\n';
+		out << K.fx << " " << 0.0f << " " << K.cx << " " << '\n'
+			<< 0.0f << " " << K.fy << " " << K.cy << " " << '\n'
+			<< 0.0f << " " << 0.0f << " " << 1.0f << " " << '\n' << '\n';
 
-		cameras_file_stream << "intrinsic" << std::endl;
-		cameras_file_stream << data.images[frame][sensor].K(0,0) << " " << data.images[frame][sensor].K(0,1) 
-							<< " " << data.images[frame][sensor].K(0,2) << " " << std::endl
-							<< data.images[frame][sensor].K(1,0) << " " << data.images[frame][sensor].K(1,1) 
-							<< " " << data.images[frame][sensor].K(1,2) << " " << std::endl
-							<< data.images[frame][sensor].K(2,0) << " " << data.images[frame][sensor].K(2,1) 
-							<< " " << data.images[frame][sensor].K(2,2) << " " << std::endl << std::endl;
+		out << img.min_depth << " " << img.max_depth << " " << '\n' << '\n';
 
-		cameras_file_stream << data.images[frame][sensor].min_depth << " " 
-							<< data.images[frame][sensor].max_depth << " " << std::endl << std::endl;
+		out << data.GetFilename(uuid) << " " << '\n';
 
-		cameras_file_stream << data.images[frame][sensor].filename << " " << std::endl;
+		if (!out.Close())
+		{
+			std::cout << "Failed to write camera file " << uuid << " for cluster " << idx << std::endl;
+			return false;
+		}
 	}
 
 	return true;
 }
 
-bool Clustering::WriteColmapCamerasFile(const std::string& path, const int idx)
+// Points are identified by their ID in the points file and images by their UUID, so that the
+// files of a cluster stay valid when frames are appended to the sequence
+
+bool Clustering::WriteColmapCamerasFile(const std::string& path, const int idx, OutputBuffer& out)
 {
 	const std::string filename = path + "cameras.txt";
-	std::ofstream cameras_file_stream(filename, std::ios::out);
-	if (!cameras_file_stream)
+	if (!out.Open(filename))
 	{
 		std::cout << "Failed to open cameras file for cluster " << idx << std::endl;
 		return false;
 	}
 
-	cameras_file_stream << "# List of cameras " << std::endl;
+	out << "# List of cameras " << '\n';
 	
 	for (int i = 0; i < data.num_cameras; i++)
 	{
-		cameras_file_stream << i << " PINHOLE " << data.images[0][i].width << " " << data.images[0][i].height
-							<< " " << data.images[0][i].K(0,0) << " " << data.images[0][i].K(1,1)
-							<< " " << data.images[0][i].K(0,2) << " " << data.images[0][i].K(1,2)
-							<< " " << std::endl;
+		const Intrinsics& K = data.intrinsics[i];
+		out << i << " PINHOLE " << K.width << " " << K.height
+			<< " " << K.fx << " " << K.fy
+			<< " " << K.cx << " " << K.cy
+			<< " " << '\n';
 	}
 
-	return true;
+	return out.Close();
 }
 
-bool Clustering::WriteColmapImagesFile(const std::string& path, const int idx)
+bool Clustering::WriteColmapImagesFile(const std::string& path, const int idx, OutputBuffer& out)
 {
 	const std::string filename = path + "images.txt";
-	std::ofstream images_file_stream(filename, std::ios::out);
-	if (!images_file_stream)
+	if (!out.Open(filename))
 	{
 		std::cout << "Failed to open images file for cluster " << idx << std::endl;
 		return false;
 	}
 	
-	images_file_stream << "# List of images " << std::endl;
+	out << "# List of images " << '\n';
 
-	for (const auto& uuid : clusters[idx].camera_idx)
+	for (const auto& uuid : clusters[idx].camera_idx.ToVector())
 	{
-		const int sensor = uuid / data.num_frames;
-		const int frame = uuid - sensor * data.num_frames;
-
-		Quaternion q = QuaternionFromRotationMatrix(data.images[frame][sensor].R);
-		const cv::Mat_<float>& t = data.images[frame][sensor].t;
+		Quaternion q = QuaternionFromRotationMatrix(data.images[uuid].pose);
+		const float* t = data.images[uuid].pose.t;
 
-		images_file_stream << uuid << " " 
-						   << q[0] << " " << q[1] << " " << q[2] << " "<< q[3] << " "
-						   << t(0,0) << " " << t(0,1) << " " << t(0,2) << " "
-						   << sensor << " " << data.images[frame][sensor].filename << " "
-						   << std::endl;
+		out << uuid << " " 
+			<< q[0] << " " << q[1] << " " << q[2] << " "<< q[3] << " "
+			<< t[0] << " " << t[1] << " " << t[2] << " "
+			<< data.GetSensor(uuid) << " " << data.GetFilename(uuid) << " "
+			<< '\n';
 
-		for (const auto& f : data.images[frame][sensor].features)
+		for (const Feature* f = data.FeaturesBegin(uuid); f != data.FeaturesEnd(uuid); f++)
 		{
-			images_file_stream << f.right.x << " " << f.right.y << " " << f.point_idx << " "; 
+			out << f->right.x << " " << f->right.y << " " << data.point_ids[f->point_idx] << " "; 
 		}
 
-		images_file_stream << std::endl;
+		out << '\n';
 	}
 
-	return true;
+	return out.Close();
 }
 
-bool Clustering::WriteColmapPointsFile(const std::string& path, const int idx)
+bool Clustering::WriteColmapPointsFile(const std::string& path, const int idx, OutputBuffer& out)
 {
 	const std::string filename = path + "points3D.txt";
-	std::ofstream points_file_stream(filename, std::ios::out);
-	if (!points_file_stream)
+	if (!out.Open(filename))
 	{
 		std::cout << "Failed to open points file for cluster " << idx << std::endl;
 		return false;
 	}
 	
-	points_file_stream << "# List of points " << std::endl;
+	out << "# List of points " << '\n';
 
 	for (const auto& p : clusters[idx].point_idx)
 	{
-		points_file_stream << p << " "
-						   << data.points[p].x << " " << data.points[p].y << " " << data.points[p].z << " "
-						   << data.points[p].r << " " << data.points[p].g << " " << data.points[p].b << " "
-						   << data.points[p].error << " ";
+		out << data.point_ids[p] << " "
+			<< data.points.x[p] << " " << data.points.y[p] << " " << data.points.z[p] << " "
+			<< int(data.points.r[p]) << " " << int(data.points.g[p]) << " " << int(data.points.b[p]) << " "
+			<< data.points.error[p] << " ";
 
-		for (const auto& f : data.points[p].image_idx)
+		for (const auto* f = data.TrackBegin(p); f != data.TrackEnd(p); f++)
 		{
-			points_file_stream << f.first << " " << f.second << " ";
+			out << f->first << " " << f->second << " ";
 		}
 
-		points_file_stream << std::endl;
+		out << '\n';
 	}
 
-	return true;
+	return out.Close();
 }
 
-// DISCLAIMER: VERY STUPID FUNCTION, A LOT OF THINGS SHOULD BE FIXED LIKE RESCALING OF CAMERAS,
-// RESCALING OF FEATURES AND SO ON
+// Binary model files, with the layout read by COLMAP (little-endian): the same content as the
+// text files, written straight from the arrays
 
-bool Clustering::WriteImages(const std::string& path, const int idx)
+bool Clustering::WriteColmapCamerasBinary(const std::string& path, const int idx, OutputBuffer& out)
 {
-	const std::string img_folder = path + "images/";
-	if (mkdir(img_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+	const std::string filename = path + "cameras.bin";
+	if (!out.Open(filename))
 	{
-		std::cout << "Failed to create the images directory for cluster " << idx << std::endl;
+		std::cout << "Failed to open cameras file for cluster " << idx << std::endl;
 		return false;
 	}
 
-	int count = 0;
-	for (const auto& uuid : clusters[idx].camera_idx)
+	const int32_t pinhole_model_id = 1;
+
+	out.WriteValue<uint64_t>(data.num_cameras);
+	for (int i = 0; i < data.num_cameras; i++)
+	{
+		const Intrinsics& K = data.intrinsics[i];
+		const double params[4] = { K.fx, K.fy, K.cx, K.cy };
+		out.WriteValue<uint32_t>(i);
+		out.WriteValue<int32_t>(pinhole_model_id);
+		out.WriteValue<uint64_t>(K.width);
+		out.WriteValue<uint64_t>(K.height);
+		out.Write(params, sizeof(params));
+	}
+
+	return out.Close();
+}
+
+bool Clustering::WriteColmapImagesBinary(const std::string& path, const int idx, OutputBuffer& out)
+{
+	const std::string filename = path + "images.bin";
+	if (!out.Open(filename))
+	{
+		std::cout << "Failed to open images file for cluster " << idx << std::endl;
+		return false;
+	}
+
+	const std::vector<int> cameras = clusters[idx].camera_idx.ToVector();
+	out.WriteValue<uint64_t>(cameras.size());
+
+	for (const auto& uuid : cameras)
+	{
+		const Quaternion q = QuaternionFromRotationMatrix(data.images[uuid].pose);
+		const float* t = data.images[uuid].pose.t;
+		const double pose[7] = { q[3], q[0], q[1], q[2], t[0], t[1], t[2] }; // COLMAP reads QW QX QY QZ
+		const std::string name = data.GetFilename(uuid);
+
+		out.WriteValue<uint32_t>(uuid);
+		out.Write(pose, sizeof(pose));
+		out.WriteValue<uint32_t>(data.GetSensor(uuid));
+		out.Write(name.c_str(), name.size() + 1);
+
+		out.WriteValue<uint64_t>(data.NumFeatures(uuid));
+		for (const Feature* f = data.FeaturesBegin(uuid); f != data.FeaturesEnd(uuid); f++)
+		{
+			const double xy[2] = { f->right.x, f->right.y };
+			out.Write(xy, sizeof(xy));
+			out.WriteValue<uint64_t>(data.point_ids[f->point_idx]);
+		}
+	}
+
+	return out.Close();
+}
+
+bool Clustering::WriteColmapPointsBinary(const std::string& path, const int idx, OutputBuffer& out)
+{
+	const std::string filename = path + "points3D.bin";
+	if (!out.Open(filename))
+	{
+		std::cout << "Failed to open points file for cluster " << idx << std::endl;
+		return false;
+	}
+
+	out.WriteValue<uint64_t>(clusters[idx].point_idx.size());
+
+	for (const auto& p : clusters[idx].point_idx)
 	{
-		const int sensor = uuid / data.num_frames;
-		const int frame = uuid - sensor * data.num_frames;
+		const double xyz[3] = { data.points.x[p], data.points.y[p], data.points.z[p] };
+		const uint8_t rgb[3] = { data.points.r[p], data.points.g[p], data.points.b[p] };
 
-		const std::string input_path = "/home/c-morsingher/datasets/vislab/full_sequence/full_size/FC/";
-		const std::string filename = input_path + data.images[frame][sensor].filename;
+		out.WriteValue<uint64_t>(data.point_ids[p]);
+		out.Write(xyz, sizeof(xyz));
+		out.Write(rgb, sizeof(rgb));
+		out.WriteValue<double>(data.points.error[p]);
 
-		cv::Mat img = cv::imread(filename, cv::IMREAD_COLOR);
-		if (img.empty())
+		out.WriteValue<uint64_t>(data.TrackEnd(p) - data.TrackBegin(p));
+		for (const auto* f = data.TrackBegin(p); f != data.TrackEnd(p); f++)
 		{
-			std::cout << "Failed to load image " << filename << std::endl;
-			return false;
+			out.WriteValue<uint32_t>(f->first);
+			out.WriteValue<uint32_t>(f->second);
 		}
+	}
 
-		cv::resize(img, img, cv::Size(), 0.25, 0.25);
-		
-		char buffer[50];
-		sprintf(buffer, "%.8d.jpg", count);
-		imwrite(img_folder + std::string(buffer), img);
-		count++;
+	return out.Close();
+}
+
+// Time the reference pairwise scoring (set_intersection + ComputeViewSelectionScore) against the
+// fused kernel on the camera pairs of the actual clusters
+
+void Clustering::BenchmarkScoreKernels(const float sigma_0, const float sigma_1, const float theta_0)
+{
+	const size_t max_pairs = 200000;
+	std::vector<std::pair<int, int>> pairs;
+	for (const auto& c : clusters)
+	{
+		const std::vector<int> cameras = c.camera_idx.ToVector();
+		for (int a = 0; a < cameras.size() && pairs.size() < max_pairs; a++)
+		{
+			for (int b = a + 1; b < cameras.size() && pairs.size() < max_pairs; b++)
+			{
+				pairs.push_back(std::make_pair(cameras[a], cameras[b]));
+			}
+		}
+	}
+
+	std::vector<float> reference(pairs.size()), fused(pairs.size());
+	const ViewSelectionWeights weights(sigma_0, sigma_1, theta_0);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int k = 0; k < pairs.size(); k++)
+	{
+		const int ref = pairs[k].first;
+		const int src = pairs[k].second;
+		std::vector<Feature> common_features;
+		std::set_intersection(data.FeaturesBegin(ref), data.FeaturesEnd(ref),
+							  data.FeaturesBegin(src), data.FeaturesEnd(src),
+							  back_inserter(common_features));
+		reference[k] = ComputeViewSelectionScore(common_features, ref, src, sigma_0, sigma_1, theta_0);
+	}
+	const double reference_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int k = 0; k < pairs.size(); k++)
+	{
+		fused[k] = ComputeFusedScore(pairs[k].first, pairs[k].second, weights);
+	}
+	const double fused_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	float max_error = 0.0f;
+	for (int k = 0; k < pairs.size(); k++)
+	{
+		max_error = std::max(max_error, std::abs(reference[k] - fused[k]) / std::max(1.0f, reference[k]));
+	}
+
+	std::cout << "Scoring " << pairs.size() << " camera pairs: " << reference_time << " s with set_intersection, " 
+			  << fused_time << " s with the fused kernel (speedup " << reference_time / fused_time 
+			  << ", max relative difference " << max_error << ")" << std::endl;
+}
+
+// Images are exported on a pool of workers, one task per image. JPEGs are decoded directly at
+// 1/2, 1/4 or 1/8 of their size (libjpeg scales in the DCT domain), so a full-resolution decode
+// is only needed for scales above 1/2. Level k > 0 of the pyramid is written in images_k/ and
+// is obtained from the previous level, so every image is decoded once.
+// An image shared by several clusters is exported only for the first one and hard-linked in
+// the others.
+
+bool Clustering::ExportImages(const std::string& output_path, const std::string& image_folder, const float scale, const int pyramid_levels)
+{
+	const auto start = std::chrono::steady_clock::now();
+	const int num_levels = std::max(1, pyramid_levels);
+
+	std::vector<std::vector<std::pair<int, int>>> copies(data.images.size()); // (cluster, index of the camera in the cluster)
+	int num_copies = 0;
+	for (int i = 0; i < clusters.size(); i++)
+	{
+		if (!modified[i])
+		{
+			continue;
+		}
+
+		const std::string cluster_folder = output_path + "cluster_" + std::to_string(i) + "/";
+		for (int l = 0; l < num_levels; l++)
+		{
+			const std::string img_folder = cluster_folder + GetImageFolder(l);
+			if (mkdir(img_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0)
+			{
+				std::cout << "Failed to create the images directory for cluster " << i << std::endl;
+				return false;
+			}
+		}
+
+		const std::vector<int> cameras = clusters[i].camera_idx.ToVector();
+		for (int k = 0; k < cameras.size(); k++)
+		{
+			copies[cameras[k]].push_back(std::make_pair(i, k));
+		}
+		num_copies += cameras.size();
+	}
+
+	std::vector<int> jobs;
+	for (int uuid = 0; uuid < copies.size(); uuid++)
+	{
+		if (!copies[uuid].empty())
+		{
+			jobs.push_back(uuid);
+		}
+	}
+
+	ThreadPool pool(data.num_threads);
+	std::vector<char> success(jobs.size(), 0);
+	std::vector<uint64_t> bytes_saved(jobs.size(), 0);
+
+	for (int j = 0; j < jobs.size(); j++)
+	{
+		pool.Submit([&, j]()
+		{
+			const int uuid = jobs[j];
+			const std::vector<std::pair<int, int>>& targets = copies[uuid];
+
+			std::vector<std::vector<std::string>> outputs(targets.size(), std::vector<std::string>(num_levels));
+			for (int c = 0; c < targets.size(); c++)
+			{
+				char buffer[50];
+				sprintf(buffer, "%.8d.jpg", targets[c].second);
+				for (int l = 0; l < num_levels; l++)
+				{
+					outputs[c][l] = output_path + "cluster_" + std::to_string(targets[c].first) + "/" + GetImageFolder(l) + buffer;
+				}
+			}
+
+			if (!ExportImage(image_folder + data.GetFilename(uuid), data.intrinsics[data.GetSensor(uuid)], scale, outputs[0]))
+			{
+				return;
+			}
+
+			for (int l = 0; l < num_levels; l++)
+			{
+				struct stat info;
+				if (stat(outputs[0][l].c_str(), &info) < 0)
+				{
+					std::cout << "Failed to stat image " << outputs[0][l] << std::endl;
+					return;
+				}
+
+				for (int c = 1; c < targets.size(); c++)
+				{
+					if (!LinkImage(outputs[0][l], outputs[c][l]))
+					{
+						std::cout << "Failed to link image " << outputs[c][l] << std::endl;
+						return;
+					}
+				}
+				bytes_saved[j] += static_cast<uint64_t>(info.st_size) * (targets.size() - 1);
+			}
+
+			success[j] = 1;
+		});
+	}
+	pool.Wait();
+
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const uint64_t total_saved = std::accumulate(bytes_saved.begin(), bytes_saved.end(), uint64_t(0));
+	Profiler::Get().Count("images_decoded", jobs.size());
+	Profiler::Get().Count("images_linked", num_copies - jobs.size());
+	Profiler::Get().Count("bytes_saved", total_saved);
+	std::cout << "Exported " << jobs.size() << " images for " << num_copies << " cluster views in " << elapsed << " s (" 
+			  << num_copies / elapsed << " views/s, " << pool.NumThreads() << " threads)" << std::endl;
+	std::cout << "Dedup ratio " << (jobs.empty() ? 1.0 : static_cast<double>(num_copies) / jobs.size()) << ", saved " 
+			  << total_saved / (1024.0 * 1024.0) << " MB" << std::endl;
+
+	return std::find(success.begin(), success.end(), 0) == success.end();
+}
+
+// Hard links need the output folder on a filesystem that supports them, otherwise the file is copied
+
+bool Clustering::LinkImage(const std::string& source, const std::string& destination)
+{
+	if (link(source.c_str(), destination.c_str()) == 0)
+	{
+		return true;
+	}
+
+	std::ifstream in(source, std::ios::binary);
+	std::ofstream out(destination, std::ios::binary);
+	if (!in.is_open() || !out.is_open())
+	{
+		return false;
+	}
+	out << in.rdbuf();
+
+	return static_cast<bool>(out);
+}
+
+std::string Clustering::GetImageFolder(const int level)
+{
+	return (level == 0) ? std::string("images/") : "images_" + std::to_string(level) + "/";
+}
+
+bool Clustering::ExportImage(const std::string& filename, const Intrinsics& K, const float scale, const std::vector<std::string>& outputs)
+{
+	ScopedTimer timer("export_image");
+	int flag = cv::IMREAD_COLOR;
+	if (scale <= 0.125f)
+	{
+		flag = cv::IMREAD_REDUCED_COLOR_8;
+	}
+	else if (scale <= 0.25f)
+	{
+		flag = cv::IMREAD_REDUCED_COLOR_4;
+	}
+	else if (scale <= 0.5f)
+	{
+		flag = cv::IMREAD_REDUCED_COLOR_2;
+	}
+
+	cv::Mat img = cv::imread(filename, flag);
+	if (img.empty())
+	{
+		std::cout << "Failed to load image " << filename << std::endl;
+		return false;
+	}
+
+	// The reduced decode rounds sizes up, the result is resized to exactly scale times the sensor size
+
+	const cv::Size size(std::round(K.width * scale), std::round(K.height * scale));
+	if (img.cols != size.width || img.rows != size.height)
+	{
+		cv::resize(img, img, size, 0, 0, cv::INTER_AREA);
+	}
+
+	for (int l = 0; l < outputs.size(); l++)
+	{
+		if (l > 0)
+		{
+			cv::pyrDown(img, img);
+		}
+		if (!cv::imwrite(outputs[l], img))
+		{
+			std::cout << "Failed to write image " << outputs[l] << std::endl;
+			return false;
+		}
 	}
 
 	return true;
-}
\ No newline at end of file
+}
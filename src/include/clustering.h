@@ -2,42 +2,100 @@
 #define CLUSTERING_H
 
 #include "input_dataset.h"
+#include "thread_pool.h"
+#include "output_buffer.h"
+
+// Node of the quadtree built by BuildQuadtree: the block of a leaf, or the nodes of the four
+// quadrants in row-major order (-1 for an empty quadrant)
+
+struct QuadtreeNode
+{
+	int block;
+	int children[4];
+};
 
 class Clustering
 {
 	InputDataset& data;
 	float x_min, x_max, z_min, z_max;
+	std::vector<std::vector<int>> adjacency; // Neighboring blocks of each block
 
 public:
 
 	std::vector<Cluster> clusters;
+	std::vector<char> modified; // Clusters to score and write: all of them, or the ones changed by UpdateClusters
 	
 	Clustering(InputDataset& input_data) : data(input_data) {};
-	void ClusterViews(const int block_size, const int min_points, const int min_cameras, const float max_distance);
-	void ComputeNeighbors(const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0);
+	void ClusterViews(const bool quadtree, const int block_size, const int max_points, const int max_cameras, 
+					  const int min_points, const int min_cameras, const float max_distance);
+	void UpdateClusters(const int num_old_images, const bool quadtree, const int block_size, const int max_points, const int max_cameras, 
+						const int min_points, const int min_cameras, const float max_distance);
+	void ComputeNeighbors(const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0, const bool inverted_index);
 	bool WriteClustersFiles(const std::string& output_path, const int num_neighbors);
-	bool WriteColmapFiles(const std::string& output_path);
+	bool ExportImages(const std::string& output_path, const std::string& image_folder, const float scale, const int pyramid_levels);
+	bool WriteColmapFiles(const std::string& output_path, const bool binary);
 	void PrintReport();
+
+	// State after ClusterViews
+
+	bool SaveSnapshot(const std::string& filename, const uint64_t key) const;
+	bool LoadSnapshot(const std::string& filename, const uint64_t key);
+
+	// Clusters and neighbors at the end of a run, restored by an incremental run
+
+	bool SaveState(const std::string& filename, const uint64_t key) const;
+	bool LoadState(const std::string& filename, const uint64_t key, int& num_old_images);
+
+	void BenchmarkScoreKernels(const float sigma_0, const float sigma_1, const float theta_0);
 	
 private:
 
-	void ComputePointCloudRange();
+	void ClusterPoints(const std::vector<int>& point_idx, const bool quadtree, const int block_size, const int max_points, const int max_cameras, 
+					   const int min_points, const int min_cameras, const float max_distance);
+	void ComputePointCloudRange(const std::vector<int>& point_idx);
 	
-	void AssignPointsToBlock(const int block_size, const int num_blocks_x);
-	void GroupByPoints(const int min_points, const int num_blocks_x);
+	void AssignPointsToBlock(const std::vector<int>& point_idx, const int block_size, const int num_blocks_x);
+	void ComputeGridAdjacency(const int num_blocks_x);
+	void BuildQuadtree(const std::vector<int>& point_idx, const int max_points, const int max_cameras, const float max_distance);
+	int SplitQuadtreeNode(const std::vector<int>& point_idx, const std::array<float, 4>& box, const int depth, 
+						  const int max_points, const int max_cameras, const float max_distance, 
+						  std::vector<QuadtreeNode>& nodes);
+	void ConnectQuadtreeNodes(const std::vector<QuadtreeNode>& nodes, const int a, const int b, const int side);
+	void MergeUndersizedBlocks(const int min_size, const bool by_cameras);
+	CameraSet CollectCameras(const std::vector<int>& point_idx, const float max_distance) const;
 	void AssignCamerasToBlock(const float max_distance);
-	void GroupByCameras(const int min_cameras, const int num_blocks_x);
+	void SplitOversizedClusters(const int max_points, const int max_cameras, const float max_distance);
+	void SplitAlongPrincipalAxis(const std::vector<int>& point_idx, const CameraSet& camera_idx, const int max_points, 
+								 const int max_cameras, const float max_distance, std::vector<Cluster>& result);
+	static bool IsOversized(const std::vector<int>& point_idx, const CameraSet& camera_idx, const int max_points, const int max_cameras);
+	static int CountUnsplittable(const std::vector<Cluster>& result, const int first, const int max_cameras);
 	
-	void ComputeNeighborsForCluster(const int i, const int num_neighbors, const float sigma_0, const float sigma_1, const float theta_0);
-	float ComputeViewSelectionScore(const std::vector<Feature>& idx, const int ref_frame, const int ref_sensor, const int src_frame, const int src_sensor, const float sigma_0, const float sigma_1, const float theta_0);
+	void ComputeNeighborsForReference(const int i, const int ref, const std::vector<int>& cameras, const int num_neighbors, const ViewSelectionWeights& weights);
+	void AccumulateTrackScores(const std::vector<int>& cameras, const int* begin, const int* end, const ViewSelectionWeights& weights, 
+							   std::unordered_map<uint64_t, float>& scores) const;
+	void SelectNeighborsFromTracks(const int i, const std::vector<int>& cameras, 
+								   const std::vector<std::unordered_map<uint64_t, float>>& chunk_scores, const int num_neighbors);
+	float ComputeFusedScore(const int ref, const int src, const ViewSelectionWeights& weights);
+	float ComputeViewSelectionScore(const std::vector<Feature>& idx, const int ref, const int src, const float sigma_0, const float sigma_1, const float theta_0);
 	
-	bool WriteCamerasFiles(const std::string& path, const int idx);
-	bool WriteNeighborsFile(const std::string& path, const int idx, const int num_neighbors);
-	bool WriteImages(const std::string& path, const int idx);
+	static void ReportThroughput(const std::vector<OutputBuffer>& buffers, const std::chrono::steady_clock::time_point& start);
+	bool WriteClusterFiles(const std::string& output_path, const int idx, const int num_neighbors, OutputBuffer& out);
+	bool WriteCamerasFiles(const std::string& path, const int idx, OutputBuffer& out);
+	bool WriteNeighborsFile(const std::string& path, const int idx, const int num_neighbors, OutputBuffer& out);
+	static bool RemoveFolder(const std::string& path);
+	void RemoveClusterFolders(const std::string& output_path) const;
+	static std::string GetImageFolder(const int level);
+	static bool LinkImage(const std::string& source, const std::string& destination);
+	static bool ExportImage(const std::string& filename, const Intrinsics& K, const float scale, const std::vector<std::string>& outputs);
+
+	bool WriteColmapCluster(const std::string& output_path, const int idx, const bool binary, OutputBuffer& out);
+	bool WriteColmapCamerasFile(const std::string& path, const int idx, OutputBuffer& out);
+	bool WriteColmapImagesFile(const std::string& path, const int idx, OutputBuffer& out);
+	bool WriteColmapPointsFile(const std::string& path, const int idx, OutputBuffer& out);
 
-	bool WriteColmapCamerasFile(const std::string& path, const int idx);
-	bool WriteColmapImagesFile(const std::string& path, const int idx);
-	bool WriteColmapPointsFile(const std::string& path, const int idx);
+	bool WriteColmapCamerasBinary(const std::string& path, const int idx, OutputBuffer& out);
+	bool WriteColmapImagesBinary(const std::string& path, const int idx, OutputBuffer& out);
+	bool WriteColmapPointsBinary(const std::string& path, const int idx, OutputBuffer& out);
 };
 
 #endif
\ No newline at end of file
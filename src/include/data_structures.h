@@ -12,28 +12,64 @@
 #include <set>
 #include <cstdlib>
 #include <thread>
+#include <atomic>
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <numeric>
 #include <opencv2/opencv.hpp>
 
-// Linux headers (for mkdir)
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Linux headers (for mkdir, mmap, nftw, readdir and getrusage)
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <sys/resource.h>
 
 struct Point
 {
-	double x, y, z;
-	int r, g, b; // TODO
-	float error;
-	std::vector<std::pair<int, int>> image_idx; // UUID
+	float x, y, z;
 	Point() : x(0.0f), y(0.0f), z(0.0f) {};
 	Point(const float x_, const float y_, const float z_) : x(x_), y(y_), z(z_) {};
 };
 
+// Point attributes stored as one array each (structure of arrays), so that passes over the
+// coordinates stream through contiguous memory and can feed the batched kernels directly
+
+struct PointCloud
+{
+	std::vector<float> x, y, z;
+	std::vector<uint8_t> r, g, b; // TODO
+	std::vector<float> error;
+
+	size_t size() const { return x.size(); }
+	Point Get(const int i) const { return Point(x[i], y[i], z[i]); }
+
+	void resize(const size_t n)
+	{
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+		r.resize(n);
+		g.resize(n);
+		b.resize(n);
+		error.resize(n);
+	}
+};
+
 struct Feature
 {
 	uint32_t point_idx;
-	cv::Point2f left, right;
-	bool operator<(const Feature& f)
+	cv::Point2f right; // Only the right camera coordinates are used in the output
+	bool operator<(const Feature& f) const
 	{
 		return point_idx < f.point_idx;
 	}
@@ -47,22 +83,154 @@ struct Neighbor
 	Neighbor(const int i, const float s) : uuid(i), score(s) {};
 };
 
-struct Image
+// Camera-to-world rigid transform stored inline, rotation in row-major order
+
+struct Pose
+{
+	float R[9];
+	float R_t[9]; // Transpose (i.e. inverse) of R, kept in sync by UpdateTranspose()
+	float t[3];
+
+	Pose() : R{1, 0, 0, 0, 1, 0, 0, 0, 1}, R_t{1, 0, 0, 0, 1, 0, 0, 0, 1}, t{0, 0, 0} {};
+
+	void UpdateTranspose()
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				R_t[3 * i + j] = R[3 * j + i];
+			}
+		}
+	}
+};
+
+// Pinhole intrinsics, shared by all the images of a sensor
+
+struct Intrinsics
 {
-	std::string filename;
 	int width, height;
-	cv::Mat_<float> K, R, t;
-	std::vector<Feature> features;
+	float fx, fy, cx, cy;
+};
+
+struct Image
+{
+	Pose pose;
 	float min_depth, max_depth;
-	std::vector<Neighbor> neighbors;
 };
 
-typedef std::vector<Image> Frame;
+// Set of cameras stored as a dense bitset over UUIDs, so that insert, merge and count work on
+// whole words. ToVector() lists the cameras in increasing order, as std::set did.
+
+struct CameraSet
+{
+	std::vector<uint64_t> words;
+
+	void Resize(const int num_uuids) { words.assign((num_uuids + 63) / 64, 0); }
+	void Clear() { std::fill(words.begin(), words.end(), 0); }
+	void Insert(const int uuid) { words[uuid >> 6] |= uint64_t(1) << (uuid & 63); }
+	bool Contains(const int uuid) const { return (words[uuid >> 6] >> (uuid & 63)) & 1; }
+
+	void Merge(const CameraSet& other)
+	{
+		if (words.size() < other.words.size())
+		{
+			words.resize(other.words.size(), 0);
+		}
+		for (int w = 0; w < other.words.size(); w++)
+		{
+			words[w] |= other.words[w];
+		}
+	}
+
+	int Count() const
+	{
+		int count = 0;
+		for (const auto& word : words)
+		{
+			count += __builtin_popcountll(word);
+		}
+		return count;
+	}
+
+	bool Empty() const
+	{
+		for (const auto& word : words)
+		{
+			if (word != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	std::vector<int> ToVector() const
+	{
+		std::vector<int> uuids;
+		uuids.reserve(Count());
+		for (int w = 0; w < words.size(); w++)
+		{
+			for (uint64_t word = words[w]; word != 0; word &= word - 1)
+			{
+				uuids.push_back(64 * w + __builtin_ctzll(word));
+			}
+		}
+		return uuids;
+	}
+};
+
+// Disjoint sets over [0, n) with union by rank and path halving
+
+struct DisjointSets
+{
+	std::vector<int> parent, rank;
+
+	DisjointSets(const int n) : parent(n), rank(n, 0)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			parent[i] = i;
+		}
+	}
+
+	int Find(int i)
+	{
+		while (parent[i] != i)
+		{
+			parent[i] = parent[parent[i]];
+			i = parent[i];
+		}
+		return i;
+	}
+
+	// Returns the root of the merged set
+
+	int Union(int a, int b)
+	{
+		a = Find(a);
+		b = Find(b);
+		if (a == b)
+		{
+			return a;
+		}
+		if (rank[a] < rank[b])
+		{
+			std::swap(a, b);
+		}
+		parent[b] = a;
+		if (rank[a] == rank[b])
+		{
+			rank[a]++;
+		}
+		return a;
+	}
+};
 
 struct Cluster
 {
 	std::vector<int> point_idx;
-	std::set<int> camera_idx; // UUID
+	CameraSet camera_idx; // UUID
 	std::unordered_map<int, std::vector<Neighbor>> neighbors;
 };
 
@@ -1,109 +1,471 @@
 #include "input_dataset.h"
 
+// Locale-free number parsing for the text inputs. Both functions skip leading blanks, parse
+// a single number in [p, end) and return the position right after it, or nullptr on failure.
+
+static const char* ParseInt(const char* p, const char* end, int& value)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+	{
+		p++;
+	}
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	if (p == end || *p < '0' || *p > '9')
+	{
+		return nullptr;
+	}
+
+	long long v = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		v = 10 * v + (*p - '0');
+		p++;
+	}
+
+	value = static_cast<int>(negative ? -v : v);
+	return p;
+}
+
+static const char* ParseDouble(const char* p, const char* end, double& value)
+{
+	static const double powers_of_ten[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+											1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+	{
+		p++;
+	}
+
+	const char* token = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		p++;
+	}
+
+	// Mantissa as an integer plus a decimal exponent
+
+	uint64_t mantissa = 0;
+	int num_digits = 0;
+	int exponent = 0;
+	bool has_digits = false;
+
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		if (num_digits < 19)
+		{
+			mantissa = 10 * mantissa + (*p - '0');
+			if (mantissa > 0)
+			{
+				num_digits++;
+			}
+		}
+		else
+		{
+			exponent++;
+			num_digits++;
+		}
+		has_digits = true;
+		p++;
+	}
+
+	if (p < end && *p == '.')
+	{
+		p++;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			if (num_digits < 19)
+			{
+				mantissa = 10 * mantissa + (*p - '0');
+				if (mantissa > 0)
+				{
+					num_digits++;
+				}
+				exponent--;
+			}
+			else
+			{
+				num_digits++;
+			}
+			has_digits = true;
+			p++;
+		}
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool negative_exponent = false;
+		if (q < end && (*q == '-' || *q == '+'))
+		{
+			negative_exponent = (*q == '-');
+			q++;
+		}
+
+		if (q < end && *q >= '0' && *q <= '9')
+		{
+			int exp_value = 0;
+			while (q < end && *q >= '0' && *q <= '9')
+			{
+				exp_value = std::min(10 * exp_value + (*q - '0'), 100000);
+				q++;
+			}
+			exponent += negative_exponent ? -exp_value : exp_value;
+			p = q;
+		}
+	}
+
+	// Exact fast path: the mantissa and the power of ten are both exactly representable,
+	// so a single multiplication or division is correctly rounded (same result as strtod)
+
+	if (has_digits && num_digits <= 15 && exponent >= -22 && exponent <= 22)
+	{
+		double v = static_cast<double>(mantissa);
+		v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+		value = negative ? -v : v;
+		return p;
+	}
+
+	// Slow path for long mantissas, large exponents and special values (nan, inf)
+
+	if (!has_digits)
+	{
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+		{
+			p++;
+		}
+	}
+
+	// strtod needs a terminated copy of the token, on the heap if it does not fit the stack buffer
+
+	char stack_buffer[64];
+	std::vector<char> heap_buffer;
+	const size_t length = p - token;
+	char* buffer = stack_buffer;
+	if (length >= sizeof(stack_buffer))
+	{
+		heap_buffer.resize(length + 1);
+		buffer = heap_buffer.data();
+	}
+	memcpy(buffer, token, length);
+	buffer[length] = '\0';
+
+	char* buffer_end;
+	value = std::strtod(buffer, &buffer_end);
+	if (buffer_end == buffer)
+	{
+		return nullptr;
+	}
+	return token + (buffer_end - buffer);
+}
+
 bool InputDataset::LoadPoints(const std::string& filename)
 {
-	std::ifstream points_file_stream(filename, std::ios::in);
-	if (!points_file_stream)
+	const auto start = std::chrono::steady_clock::now();
+
+	MappedFile points_file;
+	if (!points_file.Open(filename))
 	{
 		std::cout << "Failed to open file " << filename << std::endl;
 		return false;
 	}
 
-	std::string line;
-	std::getline(points_file_stream, line);
-	std::istringstream line_stream(line);
+	const char* begin = points_file.data();
+	const char* end = begin + points_file.size();
 
-	line_stream >> num_points;
+	// First line: number of points
+
+	if (ParseInt(begin, end, num_points) == nullptr || num_points < 0)
+	{
+		std::cout << "Failed to read the number of points from " << filename << std::endl;
+		return false;
+	}
 	points.resize(num_points);
 
-	while(!points_file_stream.eof() && !points_file_stream.bad())
+	const char* body = static_cast<const char*>(memchr(begin, '\n', end - begin));
+	body = (body == nullptr) ? end : body + 1;
+
+	// Split the remaining lines in one chunk per thread. Chunk boundaries are moved forward to
+	// the next line start, so every line is parsed by exactly one thread.
+
+	const size_t body_size = end - body;
+	const int num_chunks = std::max<size_t>(1, std::min<size_t>(num_threads, body_size / (1 << 20)));
+
+	std::vector<const char*> bounds(num_chunks + 1, end);
+	bounds[0] = body;
+	for (int t = 1; t < num_chunks; t++)
 	{
-		std::string line;
-		std::getline(points_file_stream, line);
-		std::istringstream line_stream(line);
+		const char* p = body + t * (body_size / num_chunks);
+		p = std::max(p, bounds[t - 1]);
+		const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+		bounds[t] = (eol == nullptr) ? end : eol + 1;
+	}
+
+	std::vector<size_t> loaded(num_chunks, 0);
+	std::vector<size_t> out_of_range(num_chunks, 0);
+	std::vector<size_t> malformed(num_chunks, 0);
+
+	const auto parse_lines = [&](const int t, const size_t, const size_t)
+	{
+		const char* p = bounds[t];
+		const char* chunk_end = bounds[t + 1];
+
+		while (p < chunk_end)
+		{
+			const char* eol = static_cast<const char*>(memchr(p, '\n', chunk_end - p));
+			const char* line_end = (eol == nullptr) ? chunk_end : eol;
+
+			int point_ID, color, valid;
+			double x, y, z;
+			const char* q = ParseInt(p, line_end, point_ID);
+			if (q != nullptr) q = ParseDouble(q, line_end, x);
+			if (q != nullptr) q = ParseDouble(q, line_end, y);
+			if (q != nullptr) q = ParseDouble(q, line_end, z);
+			if (q != nullptr) q = ParseInt(q, line_end, color);
+			if (q != nullptr) q = ParseInt(q, line_end, valid);
+
+			if (q == nullptr)
+			{
+				// Blank lines (e.g. at the end of the file) are not an error
+
+				const char* c = p;
+				while (c < line_end && (*c == ' ' || *c == '\t' || *c == '\r'))
+				{
+					c++;
+				}
+				if (c != line_end)
+				{
+					malformed[t]++;
+				}
+			}
+			else if (point_ID < 0 || point_ID >= num_points)
+			{
+				out_of_range[t]++;
+			}
+			else
+			{
+				points.x[point_ID] = x;
+				points.y[point_ID] = y;
+				points.z[point_ID] = z;
+				points.r[point_ID] = 0;
+				points.g[point_ID] = 0;
+				points.b[point_ID] = 0;
+				points.error[point_ID] = 0.0f;
+				loaded[t]++;
+			}
 
-		int point_ID, color, valid;
-		Point new_point;
-		line_stream >> point_ID 
-					>> new_point.x >> new_point.y >> new_point.z 
-					>> color >> valid;
+			p = line_end + 1;
+		}
+	};
+	ParallelFor(num_chunks, num_chunks, parse_lines);
 
-		new_point.r = 0;
-		new_point.g = 0;
-		new_point.b = 0;
-		new_point.error = 0.0f;
+	size_t num_loaded = 0, num_out_of_range = 0, num_malformed = 0;
+	for (int t = 0; t < num_chunks; t++)
+	{
+		num_loaded += loaded[t];
+		num_out_of_range += out_of_range[t];
+		num_malformed += malformed[t];
+	}
 
-		points[point_ID] = new_point;
+	if (num_out_of_range > 0)
+	{
+		std::cout << "Skipped " << num_out_of_range << " points with ID outside [0, " << num_points << ")" << std::endl;
+	}
+	if (num_malformed > 0)
+	{
+		std::cout << "Skipped " << num_malformed << " malformed lines" << std::endl;
+	}
+	if (num_loaded < num_points)
+	{
+		std::cout << "Warning: only " << num_loaded << " of " << num_points << " point IDs are present" << std::endl;
 	}
 
-	std::cout << "Successfully loaded " << points.size() << " points" << std::endl;
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double megabytes = points_file.size() / (1024.0 * 1024.0);
+	Profiler::Get().Count("points", points.size());
+	std::cout << "Successfully loaded " << points.size() << " points in " << elapsed << " s ("
+			  << megabytes / elapsed << " MB/s, " << num_chunks << " threads)" << std::endl;
 
 	return true;
 }
 
+// Fixed-size record of features.bin, stored right after the 16-byte header
+
+struct FeatureRecord
+{
+	uint32_t point_idx;
+	uint32_t color;
+	float left_x, left_y; // Unused
+	float right_x, right_y;
+	uint32_t sensor;
+	uint32_t frame;
+};
+
+static_assert(sizeof(FeatureRecord) == 32, "Unexpected padding in FeatureRecord");
+
 bool InputDataset::LoadFeatures(const std::string& filename)
 {
-	std::ifstream features_file_stream(filename, std::ios::in);
-	if (!features_file_stream)
+	const auto start = std::chrono::steady_clock::now();
+
+	MappedFile features_file;
+	if (!features_file.Open(filename))
 	{
 		std::cout << "Failed to open file " << filename << std::endl;
 		return false;
 	}
 
-	uint64_t buff_64;
-	features_file_stream.read((char*) &buff_64, sizeof(uint64_t));
-	const int num_features = buff_64;
+	// Header: number of features (uint64), number of frames (uint32), number of observations (uint32)
 
+	const size_t header_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+	if (features_file.size() < header_size)
+	{
+		std::cout << "File " << filename << " is too small to contain a valid header" << std::endl;
+		return false;
+	}
+
+	uint64_t buff_64;
 	uint32_t buff;
-	features_file_stream.read((char*) &buff, sizeof(uint32_t));
+	const char* ptr = features_file.data();
+
+	memcpy(&buff_64, ptr, sizeof(uint64_t));
+	const uint64_t num_features = buff_64;
+	ptr += sizeof(uint64_t);
+
+	memcpy(&buff, ptr, sizeof(uint32_t));
 	num_frames = buff;
-	images.resize(num_frames);
-	for (int i = 0; i < num_frames; i++)
+	ptr += sizeof(uint32_t);
+
+	memcpy(&buff, ptr, sizeof(uint32_t));
+	const uint64_t num_observations = buff;
+	ptr += sizeof(uint32_t);
+
+	const uint64_t num_records = (features_file.size() - header_size) / sizeof(FeatureRecord);
+	if (num_records < num_features)
 	{
-		images[i].resize(num_cameras);
+		std::cout << "File " << filename << " declares " << num_features << " features but only contains "
+				  << num_records << std::endl;
+		return false;
+	}
+	if (num_observations > num_records)
+	{
+		std::cout << "File " << filename << " declares " << num_observations << " observations but only contains "
+				  << num_records << " records" << std::endl;
+		return false;
 	}
 
-	features_file_stream.read((char*) &buff, sizeof(uint32_t));
-	const int num_observations = buff;
+	images.resize(static_cast<size_t>(num_frames) * num_cameras);
 
-	int count = 0;
-	while (!features_file_stream.eof() && !features_file_stream.bad() && count < num_features)
-	{
-		Feature new_feature;
+	// Keyframes are selected here, so that features of the other frames are never stored
+
+	FilterPoses(keyframe_step);
+
+	// Decode records in bulk into a single arena: every thread counts the features of each image
+	// in its own chunk, then writes them at the offset given by the counts of the previous images
+	// and chunks. This keeps the file order inside every image, exactly as a sequential push_back
+	// would do, so the sort below gives the same result with any number of threads.
 
-		// Point ID
-		features_file_stream.read((char*) &buff, sizeof(uint32_t));
-		new_feature.point_idx = buff;
+	const FeatureRecord* records = reinterpret_cast<const FeatureRecord*>(ptr);
+	const size_t num_images = static_cast<size_t>(num_frames) * num_cameras;
+	const int num_chunks = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, num_features / 65536));
 
-		// Color
-		features_file_stream.read((char*) &buff, sizeof(uint32_t));
+	std::vector<std::vector<size_t>> counts(num_chunks, std::vector<size_t>(num_images, 0));
+	std::vector<size_t> invalid(num_chunks, 0);
+	std::vector<size_t> skipped(num_chunks, 0);
 
-		// Left camera coordinates
-		float buff_f;
-		features_file_stream.read((char*) &buff_f, sizeof(float));
-		new_feature.left.x = buff_f;
-		features_file_stream.read((char*) &buff_f, sizeof(float));
-		new_feature.left.y = buff_f;
+	const auto count_records = [&](const int t, const size_t begin, const size_t end)
+	{
+		for (size_t k = begin; k < end; k++)
+		{
+			FeatureRecord r;
+			memcpy(&r, records + k, sizeof(FeatureRecord));
+			if (r.frame >= num_frames || r.sensor >= num_cameras || r.point_idx >= points.size())
+			{
+				invalid[t]++;
+			}
+			else if (!is_keyframe[r.frame])
+			{
+				skipped[t]++;
+			}
+			else
+			{
+				counts[t][GetUUID(r.frame, r.sensor)]++;
+			}
+		}
+	};
+	ParallelFor(num_features, num_chunks, count_records);
 
-		// Right camera coordinates
-		features_file_stream.read((char*) &buff_f, sizeof(float));
-		new_feature.right.x = buff_f;
-		features_file_stream.read((char*) &buff_f, sizeof(float));
-		new_feature.right.y = buff_f;
+	feature_offsets.resize(num_images + 1);
+	size_t offset = 0;
+	for (size_t i = 0; i < num_images; i++)
+	{
+		feature_offsets[i] = offset;
+		for (int t = 0; t < num_chunks; t++)
+		{
+			const size_t c = counts[t][i];
+			counts[t][i] = offset;
+			offset += c;
+		}
+	}
+	feature_offsets[num_images] = offset;
+	features.resize(offset);
 
-		// Sensor
-		features_file_stream.read((char*) &buff, sizeof(uint32_t));
-		const int sensor = buff;
+	const auto decode_records = [&](const int t, const size_t begin, const size_t end)
+	{
+		std::vector<size_t>& offsets = counts[t];
+		for (size_t k = begin; k < end; k++)
+		{
+			FeatureRecord r;
+			memcpy(&r, records + k, sizeof(FeatureRecord));
+			if (r.frame >= num_frames || r.sensor >= num_cameras || r.point_idx >= points.size() || !is_keyframe[r.frame])
+			{
+				continue;
+			}
 
-		// Frame
-		features_file_stream.read((char*) &buff, sizeof(uint32_t));
-		const int frame = buff;
+			Feature& f = features[offsets[GetUUID(r.frame, r.sensor)]++];
+			f.point_idx = r.point_idx;
+			f.right = cv::Point2f(r.right_x, r.right_y);
+		}
+	};
+	ParallelFor(num_features, num_chunks, decode_records);
 
-		images[frame][sensor].features.push_back(new_feature);
+	// Sort every image once by point, as needed to intersect the features of two images
 
-		count++;
+	const auto sort_images = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			std::sort(features.begin() + feature_offsets[i], features.begin() + feature_offsets[i + 1]);
+		}
+	};
+	ParallelFor(num_images, num_threads, sort_images);
+
+	size_t num_invalid = 0, num_skipped = 0;
+	for (int t = 0; t < num_chunks; t++)
+	{
+		num_invalid += invalid[t];
+		num_skipped += skipped[t];
+	}
+	if (num_invalid > 0)
+	{
+		std::cout << "Skipped " << num_invalid << " features with invalid frame, sensor or point" << std::endl;
 	}
 
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const double megabytes = (header_size + num_features * sizeof(FeatureRecord)) / (1024.0 * 1024.0);
+	Profiler::Get().Count("features", num_features - num_invalid - num_skipped);
+	Profiler::Get().Count("bytes_read", header_size + num_features * sizeof(FeatureRecord));
+	std::cout << "Successfully loaded " << num_features - num_invalid - num_skipped << " features in " << elapsed << " s ("
+			  << megabytes / elapsed << " MB/s, " << num_chunks << " threads), skipped "
+			  << num_skipped << " features of non-keyframes" << std::endl;
+
 	return true;
 }
 
@@ -116,48 +478,61 @@ bool InputDataset::LoadPoses(const std::string& filename)
 		return false;
 	}
 
+	// Intrinsics are hard-coded and shared by all sensors for now
+
+	Intrinsics K;
+	K.width = 3840;
+	K.height = 1920;
+	K.fx = 2654.375;
+	K.fy = 2654.375;
+	K.cx = 1834.875;
+	K.cy = 978.625;
+	intrinsics.assign(num_cameras, K);
+
 	int count = 0;
-	while(!poses_file_stream.eof() && !poses_file_stream.bad() && count < images.size())
+	while(!poses_file_stream.eof() && !poses_file_stream.bad() && count < num_frames)
 	{
 		std::string line;
 		std::getline(poses_file_stream, line);
-		std::istringstream line_stream(line);
 
-		for (int i = 0; i < num_cameras; i++)
-		{
-			images[count][i].K = cv::Mat::eye(3, 3, CV_32F);
-			images[count][i].R = cv::Mat::eye(3, 3, CV_32F);
-			images[count][i].t = cv::Mat::eye(3, 1, CV_32F);
+		// Poses of non-keyframes are never used
 
-			images[count][i].width = 3840;
-			images[count][i].height = 1920;
-			images[count][i].K << 2654.375, 0, 1834.875,
-							   0, 2654.375, 978.625,
-							   0, 0, 1;
+		if (!is_keyframe[count])
+		{
+			count++;
+			continue;
+		}
 
-			line_stream >> images[count][i].R(0,0) >> images[count][i].R(0,1) >> images[count][i].R(0,2) >> images[count][i].t(0,0)
-						>> images[count][i].R(1,0) >> images[count][i].R(1,1) >> images[count][i].R(1,2) >> images[count][i].t(1,0)
-						>> images[count][i].R(2,0) >> images[count][i].R(2,1) >> images[count][i].R(2,2) >> images[count][i].t(2,0);
+		std::istringstream line_stream(line);
 
-			char buffer[50];
-			sprintf(buffer, "%.8d.jpg", count);
-			images[count][i].filename = std::string(buffer);
+		for (int i = 0; i < num_cameras; i++)
+		{
+			Pose& pose = images[GetUUID(count, i)].pose;
+			line_stream >> pose.R[0] >> pose.R[1] >> pose.R[2] >> pose.t[0]
+						>> pose.R[3] >> pose.R[4] >> pose.R[5] >> pose.t[1]
+						>> pose.R[6] >> pose.R[7] >> pose.R[8] >> pose.t[2];
+			pose.UpdateTranspose();
 		}
 
 		count++;
 	}	
-	
+
+	Profiler::Get().Count("poses", filt.size());
 	return true;
 }
 
-void InputDataset::FilterPoses(const float min_dist)
+void InputDataset::FilterPoses(const int step)
 {
+	ScopedTimer timer("filter_poses");
+	// Called by LoadFeatures as soon as the number of frames is known, so keyframes
+	// are selected before features and poses are decoded
+
 	// int prev = 0;
 	// filt.push_back(prev); 
 
 	// for (int i = 1; i < images.size(); i++)
 	// {
-	// 	const float dist = ComputePoseDistance(images[prev][0].t, images[i][0].t);
+	// 	const float dist = ComputePoseDistance(images[GetUUID(prev, 0)].pose, images[GetUUID(i, 0)].pose);
 	// 	if (dist > min_dist)
 	// 	{
 	// 		prev = i;
@@ -165,26 +540,55 @@ void InputDataset::FilterPoses(const float min_dist)
 	// 	}
 	// } 
 
-	for (int i = 0; i < num_frames; i += 5)
+	filt.clear();
+	is_keyframe.assign(num_frames, 0);
+
+	for (int i = 0; i < num_frames; i += std::max(step, 1))
 	{
 		filt.push_back(i);
+		is_keyframe[i] = 1;
 	}
 }
 
 void InputDataset::ComputeDepthRange()
 {
-	for (const auto& i : filt)
+	// Every keyframe image is independent, so images are simply split among threads. Depths are
+	// kept for every feature, so that later stages do not transform the same points again.
+
+	const size_t num_jobs = filt.size() * num_cameras;
+	feature_depths.resize(features.size());
+
+	const auto compute_range = [&](const int, const size_t begin, const size_t end)
 	{
-		for (int j = 0; j < num_cameras; j++)
+		std::vector<float> x, y, z;
+
+		for (size_t job = begin; job < end; job++)
 		{
 			float max_depth = 0.0f;
 			float min_depth = std::numeric_limits<float>::max();
 
-			for (const auto& f : images[i][j].features)
+			// Gather the observed points and compute all their depths at once
+
+			const int uuid = GetUUID(filt[job / num_cameras], job % num_cameras);
+			const Feature* f = FeaturesBegin(uuid);
+			const int n = NumFeatures(uuid);
+			float* depths = &feature_depths[feature_offsets[uuid]];
+			x.resize(n);
+			y.resize(n);
+			z.resize(n);
+			for (int k = 0; k < n; k++)
+			{
+				const int p = f[k].point_idx;
+				x[k] = points.x[p];
+				y[k] = points.y[p];
+				z[k] = points.z[p];
+			}
+
+			ComputePointDepths(images[uuid].pose, x.data(), y.data(), z.data(), depths, n);
+
+			for (int k = 0; k < n; k++)
 			{
-				const int idx = f.point_idx;
-				const Point p_cam = TransformPointFromWorldToCam(images[i][j].R, images[i][j].t, points[idx]);
-				const float depth = p_cam.z;
+				const float depth = depths[k];
 				if (depth < min_depth)
 				{
 					min_depth = depth;
@@ -195,52 +599,287 @@ void InputDataset::ComputeDepthRange()
 				}
 			}
 
-			images[i][j].min_depth = min_depth;
-			images[i][j].max_depth = std::max(max_depth, 80.0f); // Fix
+			images[uuid].min_depth = min_depth;
+			images[uuid].max_depth = std::max(max_depth, 80.0f); // Fix
 		}
-	}
+	};
+	ParallelFor(num_jobs, num_threads, compute_range);
 }
 
+// Tracks are built in compressed sparse row form: observations are counted per point, visible
+// points get new consecutive IDs (in the same relative order), then observations are scattered
+// at the offsets of their point. Features are rewritten with the new IDs, so that they keep
+// pointing at the right point after the unobserved points are dropped.
+
 void InputDataset::BuildFeatureTracks()
 {
-	for (const auto& i : filt)
+	const size_t num_jobs = filt.size() * num_cameras;
+	const int old_num_points = points.size();
+
+	std::vector<std::atomic<size_t>> counts(old_num_points);
+	for (auto& c : counts)
 	{
-		for (int j = 0; j < num_cameras; j++)
+		c.store(0, std::memory_order_relaxed);
+	}
+
+	const auto count_observations = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t job = begin; job < end; job++)
 		{
-			for (int k = 0; k < images[i][j].features.size(); k++)
+			const int uuid = GetUUID(filt[job / num_cameras], job % num_cameras);
+			for (const Feature* f = FeaturesBegin(uuid); f != FeaturesEnd(uuid); f++)
 			{
-				const int point_id = images[i][j].features[k].point_idx;
-				const int uuid = j * num_frames + i;
-				points[point_id].image_idx.push_back(std::make_pair(uuid, k));
+				counts[f->point_idx].fetch_add(1, std::memory_order_relaxed);
 			}
 		}
+	};
+	ParallelFor(num_jobs, num_threads, count_observations);
+
+	// Old to new point IDs (-1 for unobserved points), counts become the write cursor of each track
+
+	std::vector<int> remap(old_num_points, -1);
+	track_offsets.assign(1, 0);
+	point_ids.clear();
+	for (int p = 0; p < old_num_points; p++)
+	{
+		const size_t c = counts[p].load(std::memory_order_relaxed);
+		if (c > 0)
+		{
+			remap[p] = track_offsets.size() - 1;
+			point_ids.push_back(p);
+			counts[p].store(track_offsets.back(), std::memory_order_relaxed);
+			track_offsets.push_back(track_offsets.back() + c);
+		}
 	}
+	const int num_visible = track_offsets.size() - 1;
+	observations.resize(track_offsets.back());
+
+	const auto scatter_observations = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t job = begin; job < end; job++)
+		{
+			const int uuid = GetUUID(filt[job / num_cameras], job % num_cameras);
+			const Feature* f = FeaturesBegin(uuid);
+			for (int k = 0; k < NumFeatures(uuid); k++)
+			{
+				observations[counts[f[k].point_idx].fetch_add(1, std::memory_order_relaxed)] = std::make_pair(uuid, k);
+			}
+		}
+	};
+	ParallelFor(num_jobs, num_threads, scatter_observations);
+
+	// The order inside a track depends on thread timing, so every track is sorted into the order
+	// of a sequential pass (keyframe, then sensor, then feature), which is the order of (UUID, feature)
+
+	const auto sort_tracks = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t p = begin; p < end; p++)
+		{
+			std::sort(observations.begin() + track_offsets[p], observations.begin() + track_offsets[p + 1]);
+		}
+	};
+	ParallelFor(num_visible, num_threads, sort_tracks);
+
+	// The remap is increasing, so every feature slice stays sorted by point
 
-	const auto lambda_size = [](const Point& p) { return p.image_idx.empty(); };
-	points.erase(std::remove_if(points.begin(), points.end(), lambda_size), points.end());
+	const auto remap_features = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t k = begin; k < end; k++)
+		{
+			features[k].point_idx = remap[features[k].point_idx];
+		}
+	};
+	ParallelFor(features.size(), num_threads, remap_features);
+
+	// Drop the points that are not observed
+
+	PointCloud visible;
+	visible.resize(num_visible);
+
+	const auto compact_points = [&](const int, const size_t begin, const size_t end)
+	{
+		for (size_t p = begin; p < end; p++)
+		{
+			const int q = remap[p];
+			if (q >= 0)
+			{
+				visible.x[q] = points.x[p];
+				visible.y[q] = points.y[p];
+				visible.z[q] = points.z[p];
+				visible.r[q] = points.r[p];
+				visible.g[q] = points.g[p];
+				visible.b[q] = points.b[p];
+				visible.error[q] = points.error[p];
+			}
+		}
+	};
+	ParallelFor(old_num_points, num_threads, compact_points);
+
+	points = std::move(visible);
+	num_points = num_visible;
+
+	Profiler::Get().Count("observations", observations.size());
 }
 
 void InputDataset::AlignData(const float alpha)
 {
-	cv::Mat_<float> R = cv::Mat::eye(3, 3, CV_32F);
-	R << 1.0, 0.0, 0.0, 
-		 0.0, std::cos(alpha), -std::sin(alpha),
-		 0.0, std::sin(alpha), std::cos(alpha);
+	const float c = std::cos(alpha);
+	const float s = std::sin(alpha);
+	const float R[9] = { 1.0, 0.0, 0.0, 
+						 0.0, c, -s,
+						 0.0, s, c };
+
+	for (const auto& i : filt)
+	{
+		Pose& pose = images[GetUUID(i, 0)].pose;
+		const Pose old_pose = pose;
+		for (int r = 0; r < 3; r++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				pose.R[3 * r + k] = R[3 * r] * old_pose.R[k] + R[3 * r + 1] * old_pose.R[3 + k] + R[3 * r + 2] * old_pose.R[6 + k];
+			}
+			pose.t[r] = R[3 * r] * old_pose.t[0] + R[3 * r + 1] * old_pose.t[1] + R[3 * r + 2] * old_pose.t[2];
+		}
+		pose.UpdateTranspose();
+	}
+
+	// Points are rotated in place in blocks through the batched kernel, blocks are split among threads
+
+	const int block_size = 4096;
+	const int num_blocks = (points.size() + block_size - 1) / block_size;
+
+	const auto rotate_blocks = [&](const int, const size_t begin_block, const size_t end_block)
+	{
+		for (size_t b = begin_block; b < end_block; b++)
+		{
+			const int begin = b * block_size;
+			const int n = std::min<int>(block_size, points.size() - begin);
+			RotatePoints(R, &points.x[begin], &points.y[begin], &points.z[begin], n);
+		}
+	};
+	ParallelFor(num_blocks, num_threads, rotate_blocks);
+}
+
+// Run AlignData and ComputeDepthRange on two copies of the dataset, with one thread and with
+// num_threads threads, then print the speedup and check that both runs give identical results
+
+void InputDataset::ReportSpeedup(const float alpha) const
+{
+	InputDataset serial = *this;
+	InputDataset parallel = *this;
+	serial.num_threads = 1;
+
+	const auto time_align = [alpha](InputDataset& d)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		d.AlignData(alpha);
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
 
-	for (int i = 0; i < num_frames; i++)
+	const auto time_depth = [](InputDataset& d)
 	{
-		images[i][0].R = R * images[i][0].R;
-		images[i][0].t = R * images[i][0].t;
+		const auto start = std::chrono::steady_clock::now();
+		d.ComputeDepthRange();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	const double align_serial = time_align(serial);
+	const double align_parallel = time_align(parallel);
+	const double depth_serial = time_depth(serial);
+	const double depth_parallel = time_depth(parallel);
+
+	bool identical = serial.points.x == parallel.points.x && 
+					 serial.points.y == parallel.points.y && 
+					 serial.points.z == parallel.points.z;
+	for (const auto& i : filt)
+	{
+		for (int j = 0; j < num_cameras; j++)
+		{
+			const Image& img1 = serial.images[GetUUID(i, j)];
+			const Image& img2 = parallel.images[GetUUID(i, j)];
+			identical = identical && memcmp(&img1.pose, &img2.pose, sizeof(Pose)) == 0 &&
+						img1.min_depth == img2.min_depth && img1.max_depth == img2.max_depth;
+		}
 	}
+	identical = identical && serial.feature_depths == parallel.feature_depths;
+
+	std::cout << "AlignData: " << align_serial << " s with 1 thread, " << align_parallel << " s with " 
+			  << num_threads << " threads (speedup " << align_serial / align_parallel << ")" << std::endl;
+	std::cout << "ComputeDepthRange: " << depth_serial << " s with 1 thread, " << depth_parallel << " s with " 
+			  << num_threads << " threads (speedup " << depth_serial / depth_parallel << ")" << std::endl;
+	std::cout << (identical ? "Parallel results are identical to the serial ones" : 
+							  "WARNING: parallel results differ from the serial ones") << std::endl;
+}
 
-	for (int i = 0; i < num_points; i++)
+std::string InputDataset::GetFilename(const int uuid) const
+{
+	char buffer[50];
+	sprintf(buffer, "%.8d.jpg", GetFrame(uuid));
+	return std::string(buffer);
+}
+
+bool InputDataset::SaveSnapshot(const std::string& filename, const uint64_t key) const
+{
+	SnapshotWriter out;
+	if (!out.Open(filename, key))
+	{
+		return false;
+	}
+
+	out.Write(num_frames);
+	out.Write(num_cameras);
+	out.Write(num_points);
+	out.WriteVector(points.x);
+	out.WriteVector(points.y);
+	out.WriteVector(points.z);
+	out.WriteVector(points.r);
+	out.WriteVector(points.g);
+	out.WriteVector(points.b);
+	out.WriteVector(points.error);
+	out.WriteVector(point_ids);
+	out.WriteVector(observations);
+	out.WriteVector(track_offsets);
+	out.WriteVector(images);
+	out.WriteVector(features);
+	out.WriteVector(feature_offsets);
+	out.WriteVector(feature_depths);
+	out.WriteVector(intrinsics);
+	out.WriteVector(filt);
+	out.WriteVector(is_keyframe);
+
+	return out.Close();
+}
+
+bool InputDataset::LoadSnapshot(const std::string& filename, const uint64_t key)
+{
+	SnapshotReader in;
+	if (!in.Open(filename, key))
 	{
-		cv::Mat_<float> p = cv::Mat::zeros(3, 1, CV_32F);
-		p << points[i].x, points[i].y, points[i].z;
+		return false;
+	}
 
-		cv::Mat_<float> p_rot = R * p;
-		points[i].x = p_rot(0,0);
-		points[i].y = p_rot(1,0);
-		points[i].z = p_rot(2,0);
+	// Read into a new state, so that a truncated snapshot leaves this dataset untouched
+
+	InputDataset state;
+	state.keyframe_step = keyframe_step;
+	state.num_threads = num_threads;
+	PointCloud& cloud = state.points;
+
+	const bool success = in.Read(state.num_frames) && in.Read(state.num_cameras) && in.Read(state.num_points) && 
+						 in.ReadVector(cloud.x) && in.ReadVector(cloud.y) && in.ReadVector(cloud.z) && 
+						 in.ReadVector(cloud.r) && in.ReadVector(cloud.g) && in.ReadVector(cloud.b) && 
+						 in.ReadVector(cloud.error) && in.ReadVector(state.point_ids) && 
+						 in.ReadVector(state.observations) && in.ReadVector(state.track_offsets) && 
+						 in.ReadVector(state.images) && in.ReadVector(state.features) && in.ReadVector(state.feature_offsets) && 
+						 in.ReadVector(state.feature_depths) && in.ReadVector(state.intrinsics) && in.ReadVector(state.filt) && 
+						 in.ReadVector(state.is_keyframe) && in.Done();
+	if (!success)
+	{
+		std::cout << "Snapshot " << filename << " is truncated" << std::endl;
+		return false;
 	}
-}
\ No newline at end of file
+
+	*this = std::move(state);
+	return true;
+}
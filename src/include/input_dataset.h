@@ -3,16 +3,29 @@
 
 #include "data_structures.h"
 #include "math_utils.h"
+#include "mapped_file.h"
+#include "parallel_utils.h"
+#include "snapshot.h"
 
 class InputDataset
 {
 public:
 
-	std::vector<Point> points;
-	std::vector<Frame> images;
+	PointCloud points;
+	std::vector<int> point_ids; // ID of every point in the points file, in increasing order
+	std::vector<std::pair<int, int>> observations; // (UUID, feature index) of all tracks, point by point
+	std::vector<size_t> track_offsets; // Track of point P is [track_offsets[P], track_offsets[P + 1])
+	std::vector<Image> images; // Indexed by UUID
+	std::vector<Feature> features; // Features of all images, image by image, sorted by point inside each image
+	std::vector<size_t> feature_offsets; // Features of image UUID are [feature_offsets[UUID], feature_offsets[UUID + 1])
+	std::vector<float> feature_depths; // Camera-space depth of every feature, filled by ComputeDepthRange
+	std::vector<Intrinsics> intrinsics; // Indexed by sensor
 	std::vector<int> filt;
+	std::vector<char> is_keyframe;
 
 	int num_frames, num_cameras, num_points;
+	int keyframe_step;
+	int num_threads;
 
 	// Input
 
@@ -22,10 +35,32 @@ public:
 	
 	// Process
 
-	void FilterPoses(const float min_dist);
+	void FilterPoses(const int step);
 	void ComputeDepthRange();
 	void BuildFeatureTracks();
 	void AlignData(const float alpha);
+	void ReportSpeedup(const float alpha) const;
+
+	// State after BuildFeatureTracks
+
+	bool SaveSnapshot(const std::string& filename, const uint64_t key) const;
+	bool LoadSnapshot(const std::string& filename, const uint64_t key);
+
+	// Images are stored frame by frame, so that UUID = frame * num_cameras + sensor and the UUIDs of a
+	// sequence do not change when frames are appended to it
+
+	int GetUUID(const int frame, const int sensor) const { return frame * num_cameras + sensor; }
+	int GetFrame(const int uuid) const { return uuid / num_cameras; }
+	int GetSensor(const int uuid) const { return uuid % num_cameras; }
+	std::string GetFilename(const int uuid) const;
+
+	const Feature* FeaturesBegin(const int uuid) const { return features.data() + feature_offsets[uuid]; }
+	const Feature* FeaturesEnd(const int uuid) const { return features.data() + feature_offsets[uuid + 1]; }
+	int NumFeatures(const int uuid) const { return feature_offsets[uuid + 1] - feature_offsets[uuid]; }
+	float GetDepth(const int uuid, const int k) const { return feature_depths[feature_offsets[uuid] + k]; }
+
+	const std::pair<int, int>* TrackBegin(const int p) const { return observations.data() + track_offsets[p]; }
+	const std::pair<int, int>* TrackEnd(const int p) const { return observations.data() + track_offsets[p + 1]; }
 };
 
-#endif
\ No newline at end of file
+#endif
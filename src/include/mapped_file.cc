@@ -0,0 +1,51 @@
+#include "mapped_file.h"
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const std::string& filename)
+{
+	Close();
+
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	size_ = st.st_size;
+	if (size_ > 0)
+	{
+		void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr == MAP_FAILED)
+		{
+			close(fd);
+			size_ = 0;
+			return false;
+		}
+		madvise(addr, size_, MADV_SEQUENTIAL);
+		data_ = static_cast<const char*>(addr);
+	}
+
+	close(fd); // The mapping stays valid after closing the descriptor
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data_ != nullptr)
+	{
+		munmap(const_cast<char*>(data_), size_);
+	}
+	data_ = nullptr;
+	size_ = 0;
+}
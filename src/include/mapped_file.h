@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "data_structures.h"
+
+// Read-only memory mapping of a whole file
+
+class MappedFile
+{
+	const char* data_;
+	size_t size_;
+
+public:
+
+	MappedFile() : data_(nullptr), size_(0) {};
+	~MappedFile();
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+#endif
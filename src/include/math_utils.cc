@@ -1,51 +1,10 @@
 #include "math_utils.h"
 
-float ComputePoseDistance(const cv::Mat_<float> t1, const cv::Mat_<float> t2)
+float ComputePoseDistance(const Pose& p1, const Pose& p2)
 {
-	return std::sqrt(std::pow(t1(0,0) - t2(0,0), 2) +
-					 std::pow(t1(1,0) - t2(1,0), 2) +
-					 std::pow(t1(2,0) - t2(2,0), 2));
-}
-
-cv::Point2f ObservePoint(const Point& p, const cv::Mat_<float>& K)
-{
-	const float u = K(0,0) * (p.x / p.z) + K(0,2);
-	const float v = K(1,1) * (p.y / p.z) + K(1,2);
-	return cv::Point2f(u, v);
-}
-
-Point ProjectPointAtDepth(const cv::Point2f& pixel, const cv::Mat_<float>& K, const float depth)
-{
-	Point p;
-	p.x = depth * (pixel.x - K(0,2)) / K(0,0);
-	p.y = depth * (pixel.y - K(1,2)) / K(1,1);
-	p.z = depth;
-	return p;
-}
-
-Point TransformPointFromWorldToCam(const cv::Mat_<float>& R, const cv::Mat_<float>& t, const Point& p)
-{
-	cv::Mat_<float> p_world = cv::Mat::eye(3, 1, CV_32F);
-	p_world << p.x, p.y, p.z;
-	cv::Mat_<float> p_cam = R.inv() * (p_world - t);
-	return Point(p_cam(0,0), p_cam(1,0), p_cam(2,0));
-}
-
-Point TransformPointFromCamToWorld(const cv::Mat_<float>& R, const cv::Mat_<float>& t, const Point& p)
-{
-	cv::Mat_<float> p_cam = cv::Mat::eye(3, 1, CV_32F);
-	p_cam << p.x, p.y, p.z;
-	cv::Mat_<float> p_world = R * p_cam + t;
-	return Point(p_world(0,0), p_world(1,0), p_world(2,0));
-}
-
-float ComputeTriangulationAngle(const Point& p, const cv::Mat_<float>& t_ref, const cv::Mat_<float>& t_src)
-{
-	cv::Vec3f v1(t_ref(0,0) - p.x, t_ref(1,0) - p.y, t_ref(2,0) - p.z);
-	cv::Vec3f v2(t_src(0,0) - p.x, t_src(1,0) - p.y, t_src(2,0) - p.z);
-	cv::Vec3f v1_norm = cv::normalize(v1);
-	cv::Vec3f v2_norm = cv::normalize(v2);
-	return (180.0f / M_PI) * acosf(v1_norm.dot(v2_norm));
+	return std::sqrt(std::pow(p1.t[0] - p2.t[0], 2) +
+					 std::pow(p1.t[1] - p2.t[1], 2) +
+					 std::pow(p1.t[2] - p2.t[2], 2));
 }
 
 Point TransformPointFromFLUToRDF(const Point& p)
@@ -53,8 +12,10 @@ Point TransformPointFromFLUToRDF(const Point& p)
 	return Point(-p.y, -p.z, p.x);
 }
 
-Quaternion QuaternionFromRotationMatrix(const cv::Mat_<float>& R)
+Quaternion QuaternionFromRotationMatrix(const Pose& pose)
 {
+	const auto R = [&pose](const int i, const int j) { return pose.R[3 * i + j]; };
+
 	Quaternion q;
 	float trace = R(0,0) + R(1,1) + R(2,2);
 	
@@ -83,3 +44,150 @@ Quaternion QuaternionFromRotationMatrix(const cv::Mat_<float>& R)
 
 	return q;
 }
+
+
+// Polynomial approximation of acos on [0, 1] (Abramowitz and Stegun 4.4.46, |error| < 2e-8 in
+// exact arithmetic; evaluated in float the error reaches about 5e-7 rad), used by both the vector
+// and the scalar path so that results do not depend on the instruction set
+
+static const float acos_coeffs[8] = { 1.5707963050f, -0.2145988016f, 0.0889789874f, -0.0501743046f,
+									  0.0308918810f, -0.0170881256f, 0.0066700901f, -0.0012624911f };
+
+float AcosDegrees(const float c)
+{
+	const float a = std::min(std::fabs(c), 1.0f);
+	float poly = acos_coeffs[7];
+	for (int k = 6; k >= 0; k--)
+	{
+		poly = poly * a + acos_coeffs[k];
+	}
+	const float r = std::sqrt(1.0f - a) * poly;
+	return (180.0f / M_PI) * (c < 0.0f ? static_cast<float>(M_PI) - r : r);
+}
+
+double ComputeViewSelectionWeight(const float theta, const float sigma_0, const float sigma_1, const float theta_0)
+{
+	if (theta <= theta_0)
+	{
+		return std::exp(- std::pow(theta - theta_0, 2) / (2 * std::pow(sigma_0, 2)));
+	}
+	else
+	{
+		return std::exp(- std::pow(theta - theta_0, 2) / (2 * std::pow(sigma_1, 2)));
+	}
+}
+
+ViewSelectionWeights::ViewSelectionWeights(const float sigma_0, const float sigma_1, const float theta_0)
+{
+	table.resize(180 * resolution + 1);
+	for (int k = 0; k < table.size(); k++)
+	{
+		table[k] = ComputeViewSelectionWeight(static_cast<float>(k) / resolution, sigma_0, sigma_1, theta_0);
+	}
+}
+
+#ifdef __AVX2__
+
+static inline __m256 AcosDegrees(const __m256 c)
+{
+	const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 a = _mm256_min_ps(_mm256_andnot_ps(sign_mask, c), one);
+	__m256 poly = _mm256_set1_ps(acos_coeffs[7]);
+	for (int k = 6; k >= 0; k--)
+	{
+		poly = _mm256_add_ps(_mm256_mul_ps(poly, a), _mm256_set1_ps(acos_coeffs[k]));
+	}
+	const __m256 r = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_sub_ps(one, a)), poly);
+	const __m256 r_neg = _mm256_sub_ps(_mm256_set1_ps(M_PI), r);
+	const __m256 negative = _mm256_cmp_ps(c, _mm256_setzero_ps(), _CMP_LT_OQ);
+	return _mm256_mul_ps(_mm256_set1_ps(180.0f / M_PI), _mm256_blendv_ps(r, r_neg, negative));
+}
+
+#endif
+
+void RotatePoints(const float* R, float* x, float* y, float* z, const int n)
+{
+	int i = 0;
+
+#ifdef __AVX2__
+	const __m256 r0 = _mm256_set1_ps(R[0]), r1 = _mm256_set1_ps(R[1]), r2 = _mm256_set1_ps(R[2]);
+	const __m256 r3 = _mm256_set1_ps(R[3]), r4 = _mm256_set1_ps(R[4]), r5 = _mm256_set1_ps(R[5]);
+	const __m256 r6 = _mm256_set1_ps(R[6]), r7 = _mm256_set1_ps(R[7]), r8 = _mm256_set1_ps(R[8]);
+	for (; i + 8 <= n; i += 8)
+	{
+		const __m256 px = _mm256_loadu_ps(x + i);
+		const __m256 py = _mm256_loadu_ps(y + i);
+		const __m256 pz = _mm256_loadu_ps(z + i);
+		_mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r0, px), _mm256_mul_ps(r1, py)), _mm256_mul_ps(r2, pz)));
+		_mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r3, px), _mm256_mul_ps(r4, py)), _mm256_mul_ps(r5, pz)));
+		_mm256_storeu_ps(z + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r6, px), _mm256_mul_ps(r7, py)), _mm256_mul_ps(r8, pz)));
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		const float px = x[i], py = y[i], pz = z[i];
+		x[i] = R[0] * px + R[1] * py + R[2] * pz;
+		y[i] = R[3] * px + R[4] * py + R[5] * pz;
+		z[i] = R[6] * px + R[7] * py + R[8] * pz;
+	}
+}
+
+// Depth of each point in the camera, the z component of the world-to-camera transform
+
+void ComputePointDepths(const Pose& pose, const float* x, const float* y, const float* z, float* depth, const int n)
+{
+	const float* R_t = pose.R_t;
+	int i = 0;
+
+#ifdef __AVX2__
+	const __m256 tx = _mm256_set1_ps(pose.t[0]), ty = _mm256_set1_ps(pose.t[1]), tz = _mm256_set1_ps(pose.t[2]);
+	const __m256 r6 = _mm256_set1_ps(R_t[6]), r7 = _mm256_set1_ps(R_t[7]), r8 = _mm256_set1_ps(R_t[8]);
+	for (; i + 8 <= n; i += 8)
+	{
+		const __m256 px = _mm256_sub_ps(_mm256_loadu_ps(x + i), tx);
+		const __m256 py = _mm256_sub_ps(_mm256_loadu_ps(y + i), ty);
+		const __m256 pz = _mm256_sub_ps(_mm256_loadu_ps(z + i), tz);
+		_mm256_storeu_ps(depth + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r6, px), _mm256_mul_ps(r7, py)), _mm256_mul_ps(r8, pz)));
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		const float px = x[i] - pose.t[0], py = y[i] - pose.t[1], pz = z[i] - pose.t[2];
+		depth[i] = R_t[6] * px + R_t[7] * py + R_t[8] * pz;
+	}
+}
+
+void ComputeTriangulationAngles(const float* x, const float* y, const float* z, 
+								const float* t_ref, const float* t_src, float* theta, const int n)
+{
+	int i = 0;
+
+#ifdef __AVX2__
+	const __m256 rx = _mm256_set1_ps(t_ref[0]), ry = _mm256_set1_ps(t_ref[1]), rz = _mm256_set1_ps(t_ref[2]);
+	const __m256 sx = _mm256_set1_ps(t_src[0]), sy = _mm256_set1_ps(t_src[1]), sz = _mm256_set1_ps(t_src[2]);
+	for (; i + 8 <= n; i += 8)
+	{
+		const __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+		const __m256 v1x = _mm256_sub_ps(rx, px), v1y = _mm256_sub_ps(ry, py), v1z = _mm256_sub_ps(rz, pz);
+		const __m256 v2x = _mm256_sub_ps(sx, px), v2y = _mm256_sub_ps(sy, py), v2z = _mm256_sub_ps(sz, pz);
+		const __m256 n1 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v1x, v1x), _mm256_mul_ps(v1y, v1y)), _mm256_mul_ps(v1z, v1z));
+		const __m256 n2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v2x, v2x), _mm256_mul_ps(v2y, v2y)), _mm256_mul_ps(v2z, v2z));
+		const __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v1x, v2x), _mm256_mul_ps(v1y, v2y)), _mm256_mul_ps(v1z, v2z));
+		const __m256 c = _mm256_div_ps(dot, _mm256_mul_ps(_mm256_sqrt_ps(n1), _mm256_sqrt_ps(n2)));
+		_mm256_storeu_ps(theta + i, AcosDegrees(c));
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		const float v1x = t_ref[0] - x[i], v1y = t_ref[1] - y[i], v1z = t_ref[2] - z[i];
+		const float v2x = t_src[0] - x[i], v2y = t_src[1] - y[i], v2z = t_src[2] - z[i];
+		const float n1 = v1x * v1x + v1y * v1y + v1z * v1z;
+		const float n2 = v2x * v2x + v2y * v2y + v2z * v2z;
+		const float dot = v1x * v2x + v1y * v2y + v1z * v2z;
+		theta[i] = AcosDegrees(dot / (std::sqrt(n1) * std::sqrt(n2)));
+	}
+}
@@ -5,14 +5,52 @@
 
 typedef std::array<float, 4> Quaternion;
 
-float ComputePoseDistance(const cv::Mat_<float> t1, const cv::Mat_<float> t2);
-cv::Point2f ObservePoint(const Point& p, const cv::Mat_<float>& K);
-Point ProjectPointAtDepth(const cv::Point2f& pixel, const cv::Mat_<float>& K, const float depth);
-Point TransformPointFromWorldToCam(const cv::Mat_<float>& R, const cv::Mat_<float>& t, const Point& p);
-Point TransformPointFromCamToWorld(const cv::Mat_<float>& R, const cv::Mat_<float>& t, const Point& p);
-float ComputeTriangulationAngle(const Point& p, const cv::Mat_<float>& t_ref, const cv::Mat_<float>& t_src);
+float ComputePoseDistance(const Pose& p1, const Pose& p2);
 Point TransformPointFromFLUToRDF(const Point& p);
 
-Quaternion QuaternionFromRotationMatrix(const cv::Mat_<float>& R);
+Quaternion QuaternionFromRotationMatrix(const Pose& pose);
 
-#endif
\ No newline at end of file
+// Angle in degrees from its cosine, matching the batched kernels below
+
+float AcosDegrees(const float c);
+
+// Gaussian weight of a triangulation angle for view selection, with sigma_0 below theta_0 and sigma_1 above
+
+double ComputeViewSelectionWeight(const float theta, const float sigma_0, const float sigma_1, const float theta_0);
+
+// Same weight tabulated over [0, 180] degrees for fixed parameters, with linear interpolation.
+// The interpolation error is below 1e-5 for sigma >= 1 degree.
+
+class ViewSelectionWeights
+{
+	static const int resolution = 128; // Samples per degree
+	std::vector<float> table;
+
+public:
+
+	ViewSelectionWeights(const float sigma_0, const float sigma_1, const float theta_0);
+
+	float operator()(const float theta) const
+	{
+		float pos = theta * resolution;
+		if (!(pos > 0.0f)) // Also catches NaN
+		{
+			pos = 0.0f;
+		}
+		pos = std::min(pos, 180.0f * resolution);
+
+		const int k = std::min(static_cast<int>(pos), 180 * resolution - 1);
+		const float w = pos - k;
+		return table[k] + w * (table[k + 1] - table[k]);
+	}
+};
+
+// Batched kernels on coordinates stored as separate x, y, z arrays of n elements.
+// They use AVX2 when the compiler targets it and a scalar loop otherwise.
+
+void RotatePoints(const float* R, float* x, float* y, float* z, const int n);
+void ComputePointDepths(const Pose& pose, const float* x, const float* y, const float* z, float* depth, const int n);
+void ComputeTriangulationAngles(const float* x, const float* y, const float* z, 
+								const float* t_ref, const float* t_src, float* theta, const int n);
+
+#endif
@@ -0,0 +1,263 @@
+#include "output_buffer.h"
+
+OutputBuffer::OutputBuffer(const size_t capacity) : buffer(std::max<size_t>(capacity, 64)), size_(0), fd(-1), failed(false), bytes_written(0)
+{
+}
+
+OutputBuffer::~OutputBuffer()
+{
+	Close();
+}
+
+bool OutputBuffer::Open(const std::string& filename)
+{
+	Close();
+	fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	failed = false;
+	return fd >= 0;
+}
+
+bool OutputBuffer::Close()
+{
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	Flush();
+	if (close(fd) < 0)
+	{
+		failed = true;
+	}
+	fd = -1;
+	return !failed;
+}
+
+bool OutputBuffer::Flush()
+{
+	const char* p = buffer.data();
+	size_t n = size_;
+	while (n > 0 && !failed)
+	{
+		const ssize_t written = write(fd, p, n);
+		if (written < 0)
+		{
+			if (errno != EINTR)
+			{
+				failed = true;
+			}
+			continue;
+		}
+		p += written;
+		n -= written;
+		bytes_written += written;
+	}
+	size_ = 0;
+	return !failed;
+}
+
+void OutputBuffer::Append(const char* s, const size_t n)
+{
+	if (size_ + n > buffer.size())
+	{
+		Flush();
+		if (n > buffer.size())
+		{
+			buffer.resize(n);
+		}
+	}
+	memcpy(buffer.data() + size_, s, n);
+	size_ += n;
+}
+
+void OutputBuffer::AppendUnsigned(unsigned long v)
+{
+	char digits[24];
+	char* p = digits + sizeof(digits);
+	do
+	{
+		*--p = '0' + v % 10;
+		v /= 10;
+	} 
+	while (v != 0);
+	Append(p, digits + sizeof(digits) - p);
+}
+
+OutputBuffer& OutputBuffer::operator<<(const char c)
+{
+	Append(&c, 1);
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const char* s)
+{
+	Append(s, strlen(s));
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const std::string& s)
+{
+	Append(s.data(), s.size());
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const int v)
+{
+	return *this << static_cast<long>(v);
+}
+
+OutputBuffer& OutputBuffer::operator<<(const unsigned int v)
+{
+	AppendUnsigned(v);
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const long v)
+{
+	if (v < 0)
+	{
+		Append("-", 1);
+		AppendUnsigned(0ul - static_cast<unsigned long>(v));
+	}
+	else
+	{
+		AppendUnsigned(v);
+	}
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const unsigned long v)
+{
+	AppendUnsigned(v);
+	return *this;
+}
+
+OutputBuffer& OutputBuffer::operator<<(const float v)
+{
+	return *this << static_cast<double>(v); // As std::ostream does
+}
+
+// Same result as printf("%g"), i.e. 6 significant digits, which is the std::ostream default.
+// The digits are computed with one scaling by an exact power of ten, which is exact enough
+// unless the value lies almost halfway between two results: those cases, and values outside
+// [1e-5, 1e15), go through snprintf.
+
+OutputBuffer& OutputBuffer::operator<<(const double v)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 
+									 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20 };
+
+	if (v == 0.0)
+	{
+		return *this << (std::signbit(v) ? "-0" : "0");
+	}
+
+	const double a = std::abs(v);
+	if (!(a >= 1e-5 && a < 1e15)) // Also NaN and infinity
+	{
+		char tmp[32];
+		const int n = snprintf(tmp, sizeof(tmp), "%g", v);
+		Append(tmp, n);
+		return *this;
+	}
+
+	// Decimal exponent e such that 10^e <= a < 10^(e + 1), then a * 10^(5 - e) is in [1e5, 1e6)
+
+	int e = std::floor(std::log10(a));
+	double scaled = (e <= 5) ? a * powers[5 - e] : a / powers[e - 5];
+	if (scaled < 1e5)
+	{
+		e--;
+		scaled = (e <= 5) ? a * powers[5 - e] : a / powers[e - 5];
+	}
+	else if (scaled >= 1e6)
+	{
+		e++;
+		scaled = (e <= 5) ? a * powers[5 - e] : a / powers[e - 5];
+	}
+
+	double integer = std::floor(scaled);
+	const double fraction = scaled - integer;
+	if (std::abs(fraction - 0.5) < 1e-6)
+	{
+		char tmp[32];
+		const int n = snprintf(tmp, sizeof(tmp), "%g", v);
+		Append(tmp, n);
+		return *this;
+	}
+	if (fraction > 0.5)
+	{
+		integer += 1.0;
+	}
+	if (integer >= 1e6) // Rounded up to the next power of ten
+	{
+		integer = 1e5;
+		e++;
+	}
+
+	char digits[6];
+	unsigned long d = static_cast<unsigned long>(integer);
+	for (int k = 5; k >= 0; k--)
+	{
+		digits[k] = '0' + d % 10;
+		d /= 10;
+	}
+
+	int num_digits = 6; // Trailing zeros are never printed
+	while (num_digits > 1 && digits[num_digits - 1] == '0')
+	{
+		num_digits--;
+	}
+
+	char out[32];
+	char* p = out;
+	if (v < 0.0)
+	{
+		*p++ = '-';
+	}
+
+	if (e < -4 || e >= 6)
+	{
+		*p++ = digits[0];
+		if (num_digits > 1)
+		{
+			*p++ = '.';
+			memcpy(p, digits + 1, num_digits - 1);
+			p += num_digits - 1;
+		}
+		*p++ = 'e';
+		*p++ = (e < 0) ? '-' : '+';
+		const int abs_e = std::abs(e);
+		if (abs_e >= 100)
+		{
+			*p++ = '0' + abs_e / 100;
+		}
+		*p++ = '0' + (abs_e / 10) % 10;
+		*p++ = '0' + abs_e % 10;
+	}
+	else if (e >= 0)
+	{
+		memcpy(p, digits, e + 1);
+		p += e + 1;
+		if (num_digits > e + 1)
+		{
+			*p++ = '.';
+			memcpy(p, digits + e + 1, num_digits - e - 1);
+			p += num_digits - e - 1;
+		}
+	}
+	else
+	{
+		*p++ = '0';
+		*p++ = '.';
+		for (int k = 0; k < -e - 1; k++)
+		{
+			*p++ = '0';
+		}
+		memcpy(p, digits, num_digits);
+		p += num_digits;
+	}
+
+	Append(out, p - out);
+	return *this;
+}
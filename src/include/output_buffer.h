@@ -0,0 +1,53 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include "data_structures.h"
+
+// Text file writer that formats into a large reusable buffer and issues few large writes.
+// Numbers are printed exactly as std::ostream prints them with the default flags, so files
+// are byte-identical to the ones written with std::ofstream.
+
+class OutputBuffer
+{
+	std::vector<char> buffer;
+	size_t size_;
+	int fd;
+	bool failed;
+	size_t bytes_written;
+
+public:
+
+	explicit OutputBuffer(const size_t capacity = 1 << 22);
+	~OutputBuffer();
+
+	bool Open(const std::string& filename);
+	bool Close(); // Returns false if any write failed
+
+	size_t BytesWritten() const { return bytes_written; } // Total over all the files written
+
+	OutputBuffer& operator<<(const char c);
+	OutputBuffer& operator<<(const char* s);
+	OutputBuffer& operator<<(const std::string& s);
+	OutputBuffer& operator<<(const int v);
+	OutputBuffer& operator<<(const unsigned int v);
+	OutputBuffer& operator<<(const long v);
+	OutputBuffer& operator<<(const unsigned long v);
+	OutputBuffer& operator<<(const float v);
+	OutputBuffer& operator<<(const double v);
+
+	// Raw bytes, for binary files (in the byte order of the machine)
+
+	void Write(const void* data, const size_t n) { Append(static_cast<const char*>(data), n); }
+	template <typename T> void WriteValue(const T& v) { Write(&v, sizeof(T)); }
+
+private:
+
+	OutputBuffer(const OutputBuffer&);
+	OutputBuffer& operator=(const OutputBuffer&);
+
+	void Append(const char* s, const size_t n);
+	void AppendUnsigned(unsigned long v);
+	bool Flush();
+};
+
+#endif
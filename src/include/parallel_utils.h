@@ -0,0 +1,57 @@
+#ifndef PARALLEL_UTILS_H
+#define PARALLEL_UTILS_H
+
+#include "data_structures.h"
+#include "profiler.h"
+
+// Number of worker threads to use when the caller does not ask for a specific value
+
+inline int DefaultNumThreads()
+{
+	const int num_threads = std::thread::hardware_concurrency();
+	return num_threads > 0 ? num_threads : 1;
+}
+
+// Split [0, num_items) in contiguous chunks, one per thread, and call func(thread_id, begin, end)
+// on each of them. Chunks are deterministic, so per-thread partial results can be merged in order.
+// Every chunk is recorded as a "parallel_for" event when profiling.
+
+template <typename Function>
+void ParallelFor(const size_t num_items, const int num_threads, const Function& func)
+{
+	const int n = std::max(1, static_cast<int>(std::min<size_t>(num_threads, num_items)));
+	const size_t chunk = (num_items + n - 1) / n;
+
+	const auto run_chunk = [&func](const int i, const size_t begin, const size_t end)
+	{
+		ScopedTimer timer("parallel_for");
+		func(i, begin, end);
+	};
+
+	if (n == 1)
+	{
+		run_chunk(0, 0, num_items);
+		return;
+	}
+
+	const auto run_worker = [&run_chunk](const int i, const size_t begin, const size_t end)
+	{
+		Profiler::SetWorkerIndex(i);
+		run_chunk(i, begin, end);
+	};
+
+	std::vector<std::thread> th_vec;
+	for (int i = 0; i < n; i++)
+	{
+		const size_t begin = std::min(num_items, i * chunk);
+		const size_t end = std::min(num_items, begin + chunk);
+		th_vec.push_back(std::thread(run_worker, i, begin, end));
+	}
+
+	for (auto& th : th_vec)
+	{
+		th.join();
+	}
+}
+
+#endif
@@ -23,16 +23,56 @@ bool Parameters::Load(const char* params_file)
 	poses_file = input_folder + d["poses_file"].GetString();
 	points_file = input_folder + d["points_file"].GetString();
 	features_file = input_folder + d["features_file"].GetString();
+	colmap_format = d["colmap_format"].GetString();
+	image_folder = d["image_folder"].GetString();
+	snapshot_folder = d["snapshot_folder"].GetString();
+	if (!snapshot_folder.empty())
+	{
+		snapshot_folder = project_path + snapshot_folder;
+	}
+	incremental = d["incremental"].GetBool();
+	metrics_file = d["metrics_file"].GetString();
+	if (!metrics_file.empty())
+	{
+		metrics_file = project_path + metrics_file;
+	}
+	trace_file = d["trace_file"].GetString();
+	if (!trace_file.empty())
+	{
+		trace_file = project_path + trace_file;
+	}
+
+	// Image export
+
+	image_scale = static_cast<float>(d["image_scale"].GetDouble());
+	pyramid_levels = d["pyramid_levels"].GetInt();
+	if (image_scale <= 0.0f || pyramid_levels < 1)
+	{
+		std::cout << "The image scale must be positive and the pyramid must have at least one level." << std::endl;
+		return false;
+	}
 
 	num_cameras = d["num_cameras"].GetInt();
 
+	// Parallelism
+
+	num_threads = d["num_threads"].GetInt();
+	if (num_threads <= 0)
+	{
+		num_threads = std::max<int>(1, std::thread::hardware_concurrency());
+	}
+	report_speedup = d["report_speedup"].GetBool();
+
 	// Keyframe selection
 
-	min_difference = static_cast<float>(d["min_difference"].GetDouble());
+	keyframe_step = d["keyframe_step"].GetInt();
 
 	// Clustering 
 
+	partitioning = d["partitioning"].GetString();
 	block_size = d["block_size"].GetInt();
+	max_points = d["max_points"].GetInt();
+	max_cameras = d["max_cameras"].GetInt();
 	min_points = d["min_points"].GetInt();
 	min_cameras = d["min_cameras"].GetInt();
 	max_distance = static_cast<float>(d["max_distance"].GetDouble());
@@ -40,6 +80,7 @@ bool Parameters::Load(const char* params_file)
 	// Neighbors
 
 	num_neighbors = d["num_neighbors"].GetInt();
+	neighbor_engine = d["neighbor_engine"].GetString();
 	theta_0 = static_cast<float>(d["theta_0"].GetDouble());
 	sigma_0 = static_cast<float>(d["sigma_0"].GetDouble());
 	sigma_1 = static_cast<float>(d["sigma_1"].GetDouble());
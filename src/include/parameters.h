@@ -20,16 +20,35 @@ public:
 	std::string poses_file;
 	std::string points_file;
 	std::string features_file;
+	std::string colmap_format; // "text" or "binary"
+	std::string image_folder; // Source images, named after their frame
+	std::string snapshot_folder; // Empty if snapshots are disabled
+	bool incremental; // Update the clusters of the last run instead of starting over (needs snapshots)
+	std::string metrics_file; // Per-stage metrics in JSON, empty to disable
+	std::string trace_file; // Chrome trace of the run, empty to disable
+
+	// Image export
+
+	float image_scale;
+	int pyramid_levels; // 1 writes only images/, more levels are written in images_1/, images_2/...
 
 	int num_cameras;
 
+	// Parallelism (0 threads means all the available cores)
+
+	int num_threads;
+	bool report_speedup;
+
 	// Keyframe selection
 
-	float min_difference;
+	int keyframe_step;
 
 	// Clustering
 
+	std::string partitioning; // "quadtree" (point and camera budgets) or "grid" (fixed block_size)
 	int block_size;
+	int max_points;
+	int max_cameras; // Also an upper bound for every emitted cluster (0 means no limit)
 	int min_points;
 	int min_cameras;
 	float max_distance;
@@ -37,6 +56,7 @@ public:
 	// Neighbors
 
 	int num_neighbors;
+	std::string neighbor_engine; // "inverted" (point tracks) or "pairwise" (feature intersections)
 	float theta_0;
 	float sigma_0;
 	float sigma_1;
@@ -0,0 +1,324 @@
+#include "profiler.h"
+
+// Heap allocations of all threads, counted by the replaced global operator new once the profiler
+// is enabled. Every thread counts its own allocations, so threads do not share a cache line, and
+// adds them to the totals when it exits.
+
+static std::atomic<bool> count_allocations(false);
+static std::atomic<uint64_t> exited_allocations(0);
+static std::atomic<uint64_t> exited_allocated_bytes(0);
+
+struct AllocationCounter
+{
+	uint64_t allocations, allocated_bytes;
+
+	~AllocationCounter()
+	{
+		exited_allocations.fetch_add(allocations, std::memory_order_relaxed);
+		exited_allocated_bytes.fetch_add(allocated_bytes, std::memory_order_relaxed);
+	}
+};
+
+static thread_local AllocationCounter thread_counter = { 0, 0 };
+
+static void* CountedAlloc(const size_t size)
+{
+	if (count_allocations.load(std::memory_order_relaxed))
+	{
+		thread_counter.allocations++;
+		thread_counter.allocated_bytes += size;
+	}
+	return malloc(size > 0 ? size : 1);
+}
+
+// Totals at a stage boundary, on the main thread. Worker threads are always joined before the
+// stage that started them ends, so their counts have been added by then.
+
+static uint64_t NumAllocations()
+{
+	return exited_allocations.load(std::memory_order_relaxed) + thread_counter.allocations;
+}
+
+static uint64_t NumAllocatedBytes()
+{
+	return exited_allocated_bytes.load(std::memory_order_relaxed) + thread_counter.allocated_bytes;
+}
+
+void* operator new(size_t size)
+{
+	void* ptr = CountedAlloc(size);
+	if (ptr == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	void* ptr = CountedAlloc(size);
+	if (ptr == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+Profiler& Profiler::Get()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+void Profiler::Enable()
+{
+	origin = std::chrono::steady_clock::now();
+	enabled.store(true, std::memory_order_relaxed);
+	count_allocations.store(true, std::memory_order_relaxed);
+}
+
+// Row of the calling thread in the trace: the main thread is 0 and worker k of a ParallelFor or
+// of a ThreadPool is k + 1, so the threads of successive parallel sections share rows
+
+static thread_local int thread_index = 0;
+
+int Profiler::ThreadIndex()
+{
+	return thread_index;
+}
+
+void Profiler::SetWorkerIndex(const int worker)
+{
+	thread_index = worker + 1;
+}
+
+void Profiler::StartStage(const std::string& name)
+{
+	if (!Enabled())
+	{
+		return;
+	}
+	StopStage();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	Stage stage;
+	stage.name = name;
+	stage.begin = Now();
+	stages.push_back(stage);
+	stage_running = true;
+	stage_allocations = NumAllocations();
+	stage_allocated_bytes = NumAllocatedBytes();
+}
+
+void Profiler::StopStage()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!stage_running)
+	{
+		return;
+	}
+
+	Stage& stage = stages.back();
+	stage.end = Now();
+	stage.peak_rss = PeakRSS();
+	stage.allocations = NumAllocations() - stage_allocations;
+	stage.allocated_bytes = NumAllocatedBytes() - stage_allocated_bytes;
+	stage_running = false;
+}
+
+void Profiler::Count(const std::string& name, const uint64_t n)
+{
+	if (!Enabled())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	AddTo(counters, name, n);
+	if (stage_running)
+	{
+		AddTo(stages.back().counters, name, n);
+	}
+}
+
+void Profiler::Record(const char* name, const std::chrono::steady_clock::time_point& begin, const std::chrono::steady_clock::time_point& end)
+{
+	Event event;
+	event.name = name;
+	event.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - origin).count();
+	event.end = std::chrono::duration_cast<std::chrono::nanoseconds>(end - origin).count();
+	event.thread = ThreadIndex();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	events.push_back(event);
+}
+
+void Profiler::AddTo(std::vector<std::pair<std::string, uint64_t>>& list, const std::string& name, const uint64_t n)
+{
+	for (auto& c : list)
+	{
+		if (c.first == name)
+		{
+			c.second += n;
+			return;
+		}
+	}
+	list.push_back(std::make_pair(name, n));
+}
+
+size_t Profiler::PeakRSS()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+	{
+		return 0;
+	}
+	return static_cast<size_t>(usage.ru_maxrss) * 1024; // Kilobytes on Linux
+}
+
+static void WriteCounters(OutputBuffer& out, const std::vector<std::pair<std::string, uint64_t>>& counters)
+{
+	out << '{';
+	for (int i = 0; i < counters.size(); i++)
+	{
+		out << (i > 0 ? ", " : " ") << '"' << counters[i].first << "\": " << counters[i].second;
+	}
+	out << (counters.empty() ? "}" : " }");
+}
+
+// Times are in seconds and sizes in megabytes. Timers are summed by name, in the order in which
+// they first ended.
+
+bool Profiler::WriteMetrics(const std::string& filename)
+{
+	StopStage();
+	std::lock_guard<std::mutex> lock(mutex);
+
+	OutputBuffer out(1 << 16);
+	if (!out.Open(filename))
+	{
+		return false;
+	}
+
+	const double megabyte = 1024.0 * 1024.0;
+
+	out << "{\n";
+	out << "\t\"total_time\": " << Now() * 1e-9 << ",\n";
+	out << "\t\"peak_rss_mb\": " << PeakRSS() / megabyte << ",\n";
+	out << "\t\"allocations\": " << NumAllocations() << ",\n";
+	out << "\t\"allocated_mb\": " << NumAllocatedBytes() / megabyte << ",\n";
+
+	out << "\t\"stages\": [\n";
+	for (int i = 0; i < stages.size(); i++)
+	{
+		const Stage& s = stages[i];
+		out << "\t\t{ \"name\": \"" << s.name << "\", \"time\": " << (s.end - s.begin) * 1e-9 
+			<< ", \"peak_rss_mb\": " << s.peak_rss / megabyte << ", \"allocations\": " << s.allocations 
+			<< ", \"allocated_mb\": " << s.allocated_bytes / megabyte << ", \"counters\": ";
+		WriteCounters(out, s.counters);
+		out << (i + 1 < stages.size() ? " },\n" : " }\n");
+	}
+	out << "\t],\n";
+
+	std::vector<const char*> names;
+	std::vector<uint64_t> count;
+	std::vector<int64_t> total, longest;
+	for (const auto& e : events)
+	{
+		int k = 0;
+		while (k < names.size() && strcmp(names[k], e.name) != 0)
+		{
+			k++;
+		}
+		if (k == names.size())
+		{
+			names.push_back(e.name);
+			count.push_back(0);
+			total.push_back(0);
+			longest.push_back(0);
+		}
+		count[k]++;
+		total[k] += e.end - e.begin;
+		longest[k] = std::max(longest[k], e.end - e.begin);
+	}
+
+	out << "\t\"timers\": [\n";
+	for (int k = 0; k < names.size(); k++)
+	{
+		out << "\t\t{ \"name\": \"" << names[k] << "\", \"count\": " << count[k] << ", \"total_time\": " << total[k] * 1e-9 
+			<< ", \"max_time\": " << longest[k] * 1e-9 << (k + 1 < names.size() ? " },\n" : " }\n");
+	}
+	out << "\t],\n";
+
+	out << "\t\"counters\": ";
+	WriteCounters(out, counters);
+	out << "\n}\n";
+
+	return out.Close();
+}
+
+// Chrome trace event format: one complete event per stage (on the main thread) and per timer,
+// with timestamps in microseconds
+
+bool Profiler::WriteTrace(const std::string& filename)
+{
+	StopStage();
+	std::lock_guard<std::mutex> lock(mutex);
+
+	OutputBuffer out;
+	if (!out.Open(filename))
+	{
+		return false;
+	}
+
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	bool first = true;
+	const auto write_event = [&](const char* name, const int64_t begin, const int64_t end, const int thread)
+	{
+		out << (first ? "" : ",\n") << "{\"name\": \"" << name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread 
+			<< ", \"ts\": " << begin / 1000 << ", \"dur\": " << (end - begin) / 1000 << '}';
+		first = false;
+	};
+
+	for (const auto& s : stages)
+	{
+		write_event(s.name.c_str(), s.begin, s.end, 0);
+	}
+	for (const auto& e : events)
+	{
+		write_event(e.name, e.begin, e.end, e.thread);
+	}
+	out << "\n]}\n";
+
+	return out.Close();
+}
@@ -0,0 +1,104 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "data_structures.h"
+#include "output_buffer.h"
+
+#include <mutex>
+
+// Instrumentation of a run. Stages are the sequential steps of main: each one records its wall
+// time, the peak RSS at its end, the heap allocations made by all threads and the items counted
+// while it runs. Timers record events of any thread, which are summed by name in the metrics and
+// drawn per worker in the Chrome trace (chrome://tracing or Perfetto). Nothing is recorded until
+// the profiler is enabled.
+
+class Profiler
+{
+	struct Event
+	{
+		const char* name;
+		int64_t begin, end; // Nanoseconds since the profiler was enabled
+		int thread;
+	};
+
+	struct Stage
+	{
+		std::string name;
+		int64_t begin, end;
+		size_t peak_rss;
+		uint64_t allocations, allocated_bytes;
+		std::vector<std::pair<std::string, uint64_t>> counters;
+	};
+
+	std::atomic<bool> enabled;
+	std::chrono::steady_clock::time_point origin;
+
+	std::mutex mutex;
+	std::vector<Event> events;
+	std::vector<Stage> stages;
+	std::vector<std::pair<std::string, uint64_t>> counters; // Totals of the run
+	bool stage_running;
+	uint64_t stage_allocations, stage_allocated_bytes; // Counts when the current stage started
+
+public:
+
+	static Profiler& Get();
+
+	void Enable();
+	bool Enabled() const { return enabled.load(std::memory_order_relaxed); }
+
+	void StartStage(const std::string& name); // Stops the current stage, if any
+	void StopStage();
+	void Count(const std::string& name, const uint64_t n);
+	void Record(const char* name, const std::chrono::steady_clock::time_point& begin, const std::chrono::steady_clock::time_point& end);
+
+	bool WriteMetrics(const std::string& filename);
+	bool WriteTrace(const std::string& filename);
+
+	static size_t PeakRSS(); // Bytes
+	static void SetWorkerIndex(const int worker); // Called by every worker thread when it starts
+
+private:
+
+	Profiler() : enabled(false), stage_running(false), stage_allocations(0), stage_allocated_bytes(0) {};
+	Profiler(const Profiler&);
+	Profiler& operator=(const Profiler&);
+
+	int64_t Now() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count(); }
+	static int ThreadIndex();
+	static void AddTo(std::vector<std::pair<std::string, uint64_t>>& list, const std::string& name, const uint64_t n);
+};
+
+// Records its lifetime as an event of the calling thread. The name must outlive the profiler.
+
+class ScopedTimer
+{
+	const char* name;
+	bool active;
+	std::chrono::steady_clock::time_point begin;
+
+public:
+
+	explicit ScopedTimer(const char* event_name) : name(event_name), active(Profiler::Get().Enabled())
+	{
+		if (active)
+		{
+			begin = std::chrono::steady_clock::now();
+		}
+	}
+
+	~ScopedTimer()
+	{
+		if (active)
+		{
+			Profiler::Get().Record(name, begin, std::chrono::steady_clock::now());
+		}
+	}
+
+private:
+
+	ScopedTimer(const ScopedTimer&);
+	ScopedTimer& operator=(const ScopedTimer&);
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "snapshot.h"
+
+// Bump when the content of any snapshot changes
+
+static const char snapshot_magic[8] = {'M', 'V', 'C', 'S', 'N', 'A', 'P', '\0'};
+static const uint32_t snapshot_version = 3;
+
+void SnapshotKey::Add(const void* data, const size_t n)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < n; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+}
+
+void SnapshotKey::Add(const std::string& s)
+{
+	Add<uint64_t>(s.size());
+	Add(s.data(), s.size());
+}
+
+bool SnapshotKey::AddFile(const std::string& filename)
+{
+	struct stat info;
+	if (stat(filename.c_str(), &info) < 0)
+	{
+		return false;
+	}
+
+	Add(filename);
+	Add<int64_t>(info.st_size);
+	Add<int64_t>(info.st_mtim.tv_sec);
+	Add<int64_t>(info.st_mtim.tv_nsec);
+	return true;
+}
+
+bool SnapshotWriter::Open(const std::string& snapshot_file, const uint64_t key)
+{
+	filename = snapshot_file;
+	if (!out.Open(filename + ".tmp"))
+	{
+		return false;
+	}
+
+	out.Write(snapshot_magic, sizeof(snapshot_magic));
+	out.WriteValue(snapshot_version);
+	out.WriteValue(key);
+	return true;
+}
+
+bool SnapshotWriter::Close()
+{
+	if (!out.Close())
+	{
+		unlink((filename + ".tmp").c_str());
+		return false;
+	}
+	return rename((filename + ".tmp").c_str(), filename.c_str()) == 0;
+}
+
+bool SnapshotReader::Open(const std::string& snapshot_file, const uint64_t key)
+{
+	pos = 0;
+	if (!file.Open(snapshot_file))
+	{
+		return false;
+	}
+
+	char magic[sizeof(snapshot_magic)];
+	uint32_t version;
+	uint64_t stored_key;
+	if (!Read(magic) || std::memcmp(magic, snapshot_magic, sizeof(magic)) != 0 || 
+		!Read(version) || version != snapshot_version || !Read(stored_key) || stored_key != key)
+	{
+		file.Close();
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,84 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "data_structures.h"
+#include "mapped_file.h"
+#include "output_buffer.h"
+
+// Binary snapshots of the pipeline state, used to skip the stages whose inputs did not change.
+// A snapshot stores a key, the hash of the input files and of the parameters of the stages it
+// covers, and is only loaded back with the same key and format version. Values are stored raw,
+// in the byte order of the machine.
+
+class SnapshotKey
+{
+	uint64_t hash;
+
+public:
+
+	SnapshotKey() : hash(14695981039346656037ULL) {}; // FNV-1a offset basis
+
+	void Add(const void* data, const size_t n);
+	void Add(const std::string& s);
+	template <typename T> void Add(const T& v) { Add(&v, sizeof(T)); }
+	bool AddFile(const std::string& filename); // Path, size and modification time, the content is not read
+
+	uint64_t Value() const { return hash; }
+};
+
+class SnapshotWriter
+{
+	OutputBuffer out;
+	std::string filename;
+
+public:
+
+	bool Open(const std::string& snapshot_file, const uint64_t key);
+	bool Close(); // The snapshot only replaces an older one when it has been written completely
+
+	template <typename T> void Write(const T& v) { out.WriteValue(v); }
+	template <typename T> void WriteVector(const std::vector<T>& v)
+	{
+		out.WriteValue<uint64_t>(v.size());
+		out.Write(v.data(), v.size() * sizeof(T));
+	}
+};
+
+class SnapshotReader
+{
+	MappedFile file;
+	size_t pos;
+
+public:
+
+	SnapshotReader() : pos(0) {};
+
+	bool Open(const std::string& snapshot_file, const uint64_t key); // False if missing, stale or of another version
+	bool Done() const { return pos == file.size(); }
+
+	template <typename T> bool Read(T& v)
+	{
+		if (file.size() - pos < sizeof(T))
+		{
+			return false;
+		}
+		std::memcpy(&v, file.data() + pos, sizeof(T));
+		pos += sizeof(T);
+		return true;
+	}
+
+	template <typename T> bool ReadVector(std::vector<T>& v)
+	{
+		uint64_t n;
+		if (!Read(n) || n > (file.size() - pos) / sizeof(T))
+		{
+			return false;
+		}
+		v.resize(n);
+		std::memcpy(static_cast<void*>(v.data()), file.data() + pos, n * sizeof(T));
+		pos += n * sizeof(T);
+		return true;
+	}
+};
+
+#endif
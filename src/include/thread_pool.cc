@@ -0,0 +1,134 @@
+#include "thread_pool.h"
+#include "profiler.h"
+
+// Pool and index of the worker running on the current thread, if any
+
+static thread_local const ThreadPool* worker_pool = nullptr;
+static thread_local int worker_id = -1;
+
+ThreadPool::ThreadPool(const int num_threads) : num_queued(0), num_pending(0), next_queue(0), stop(false)
+{
+	const int n = std::max(1, num_threads);
+	for (int i = 0; i < n; i++)
+	{
+		queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+	}
+	for (int i = 0; i < n; i++)
+	{
+		workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	Wait();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	task_available.notify_all();
+
+	for (auto& th : workers)
+	{
+		th.join();
+	}
+}
+
+void ThreadPool::Submit(const std::function<void()>& task)
+{
+	// Tasks submitted by a worker go to its own deque, the others are spread round-robin
+
+	int target;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		target = (worker_pool == this) ? worker_id : next_queue++ % queues.size();
+		num_pending++;
+	}
+
+	{
+		std::lock_guard<std::mutex> queue_lock(queues[target]->mutex);
+		queues[target]->tasks.push_back(task);
+
+		std::lock_guard<std::mutex> lock(mutex); // Same lock order as PopTask
+		num_queued++;
+	}
+	task_available.notify_one();
+}
+
+// Must not be called from a task
+
+void ThreadPool::Wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	all_done.wait(lock, [this] { return num_pending == 0; });
+}
+
+void ThreadPool::WorkerLoop(const int id)
+{
+	worker_pool = this;
+	worker_id = id;
+	Profiler::SetWorkerIndex(id);
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			task_available.wait(lock, [this] { return stop || num_queued > 0; });
+			if (stop && num_queued == 0)
+			{
+				return;
+			}
+		}
+
+		std::function<void()> task;
+		if (!PopTask(id, task))
+		{
+			continue; // Another worker took it first
+		}
+
+		task();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--num_pending == 0)
+		{
+			all_done.notify_all();
+		}
+	}
+}
+
+bool ThreadPool::PopTask(const int id, std::function<void()>& task)
+{
+	const int n = queues.size();
+	for (int k = 0; k < n; k++)
+	{
+		TaskQueue& q = *queues[(id + k) % n];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty())
+		{
+			continue;
+		}
+
+		if (k == 0)
+		{
+			task = std::move(q.tasks.back()); // Own deque: most recent task first
+			q.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(q.tasks.front()); // Steal the oldest task of another worker
+			q.tasks.pop_front();
+		}
+
+		std::lock_guard<std::mutex> global_lock(mutex);
+		num_queued--;
+		return true;
+	}
+
+	return false;
+}
+
+int ThreadPool::WorkerId() const
+{
+	return (worker_pool == this) ? worker_id : -1;
+}
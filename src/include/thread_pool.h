@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "data_structures.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+// Fixed-size pool of workers, each owning a task deque. A worker pops its own tasks from the
+// back and, when it runs out of work, steals from the front of the other deques, so skewed
+// workloads are balanced without ever running more than num_threads threads.
+
+class ThreadPool
+{
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<TaskQueue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable task_available, all_done;
+	size_t num_queued, num_pending, next_queue;
+	bool stop;
+
+public:
+
+	explicit ThreadPool(const int num_threads);
+	~ThreadPool();
+
+	void Submit(const std::function<void()>& task);
+	void Wait();
+	int NumThreads() const { return workers.size(); }
+	int WorkerId() const; // Index of the calling worker, -1 if not called from a task of this pool
+
+private:
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	void WorkerLoop(const int id);
+	bool PopTask(const int id, std::function<void()>& task);
+};
+
+#endif
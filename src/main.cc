@@ -1,124 +1,307 @@
 #include "input_dataset.h"
 #include "clustering.h"
 #include "parameters.h"
+#include "profiler.h"
 
-// Test for new URL
+// Stages from the input files to the feature tracks
 
-int main(int argc, char** argv) 
+static bool PrepareDataset(const Parameters& params, const float alpha, InputDataset& dataset)
 {
-	std::cout << std::endl;
-
-	// Check if the files has been provided
-
-	if (argc != 2)
-	{
-		std::cout << "Usage " << argv[0] << " PATH_TO_CONFIG_FILE" << std::endl;
-		return EXIT_FAILURE;
-	}
-
-	// Load parameters
-
-	std::cout << "Loading parameters..." << std::endl;
-	Parameters params;
-	if (!params.Load(argv[1]))
-	{
-		std::cout << "Failed to load parameters" << std::endl;
-		return EXIT_FAILURE;
-	}
-	std::cout << "Done!" << std::endl << std::endl;;
-
 	// Load input dataset
 
 	std::cout << "Loading input Ambarella dataset..." << std::endl;
 
-	InputDataset dataset;
-	dataset.num_cameras = params.num_cameras;
-
 	// state.bap file (points)
 
+	Profiler& profiler = Profiler::Get();
+	profiler.StartStage("load_points");
 	if(!dataset.LoadPoints(params.points_file))
 	{
 		std::cout << "Failed to load points" << std::endl;
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	// state.bin file (features)
+	// state.bin file (features), keyframes are selected while loading
 
+	profiler.StartStage("load_features");
 	if (!dataset.LoadFeatures(params.features_file))
 	{
 		std::cout << "Failed to load features" << std::endl;
-		return EXIT_FAILURE;
+		return false;
 	}
 
 	// outputPose_correct.txt file (poses)
 
+	profiler.StartStage("load_poses");
 	if (!dataset.LoadPoses(params.poses_file))
 	{
 		std::cout << "Failed to load poses" << std::endl;
-		return EXIT_FAILURE;
+		return false;
 	}
 
-	std::cout << "Done!" << std::endl << std::endl;
+	std::cout << "Done! Selected " << dataset.filt.size() << " keyframes" << std::endl << std::endl;
 
 	// Aligning points and poses
 
+	if (params.report_speedup)
+	{
+		std::cout << "Measuring speedup of the parallel stages..." << std::endl;
+		profiler.StartStage("report_speedup");
+		dataset.ReportSpeedup(alpha);
+		std::cout << "Done!" << std::endl << std::endl;
+	}
+
 	std::cout << "Aligning points and poses..." << std::endl;
-	const float alpha =  - 9.3 * M_PI / 180.0;
+	profiler.StartStage("align");
 	dataset.AlignData(alpha);
 	std::cout << "Done!" << std::endl << std::endl;
 
-	// Filter out redundant poses
-
-	std::cout << "Filtering poses by selecting keyframes..." << std::endl;
-	dataset.FilterPoses(params.min_difference);
-	std::cout << "Done! Selected " << dataset.filt.size() << " keyframes" << std::endl << std::endl;
-
 	// Compute depth range
 
 	std::cout << "Computing depth range for selected keyframes..." << std::endl;
+	profiler.StartStage("depth_range");
 	dataset.ComputeDepthRange();
 	std::cout << "Done!" << std::endl << std::endl;
 
 	// Assign images to each point and remove useless points
 
 	std::cout << "Assigning keyframes to each visible point..." << std::endl;
+	profiler.StartStage("tracks");
 	dataset.BuildFeatureTracks();
+	profiler.StopStage();
 	std::cout << "Done! There are " << dataset.points.size() << " visible points" << std::endl << std::endl;
 
+	return true;
+}
+
+// Metrics and trace of the run, written whether it succeeded or not. Returns status.
+
+static int FinishRun(const Parameters& params, const int status)
+{
+	Profiler& profiler = Profiler::Get();
+	if (!params.metrics_file.empty() && !profiler.WriteMetrics(params.metrics_file))
+	{
+		std::cout << "Warning: failed to write metrics to " << params.metrics_file << std::endl;
+	}
+	if (!params.trace_file.empty() && !profiler.WriteTrace(params.trace_file))
+	{
+		std::cout << "Warning: failed to write trace to " << params.trace_file << std::endl;
+	}
+
+	return status;
+}
+
+// Test for new URL
+
+int main(int argc, char** argv) 
+{
+	std::cout << std::endl;
+
+	// Check if the files has been provided
+
+	if (argc != 2)
+	{
+		std::cout << "Usage " << argv[0] << " PATH_TO_CONFIG_FILE" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Load parameters
+
+	std::cout << "Loading parameters..." << std::endl;
+	Parameters params;
+	if (!params.Load(argv[1]))
+	{
+		std::cout << "Failed to load parameters" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "Done!" << std::endl << std::endl;;
+
+	// Profiling is enabled by any of its outputs
+
+	Profiler& profiler = Profiler::Get();
+	if (!params.metrics_file.empty() || !params.trace_file.empty())
+	{
+		profiler.Enable();
+	}
+
+	// Snapshots skip the stages whose inputs and parameters did not change since the last run
+
+	const float alpha =  - 9.3 * M_PI / 180.0;
+	const bool use_snapshots = !params.snapshot_folder.empty();
+	if (use_snapshots)
+	{
+		mkdir(params.snapshot_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	}
+
+	SnapshotKey dataset_key;
+	const bool has_inputs = dataset_key.AddFile(params.points_file) && dataset_key.AddFile(params.features_file) && 
+							dataset_key.AddFile(params.poses_file);
+	dataset_key.Add(params.num_cameras);
+	dataset_key.Add(params.keyframe_step);
+	dataset_key.Add(alpha);
+
+	SnapshotKey clustering_key;
+	clustering_key.Add(dataset_key.Value());
+	clustering_key.Add(params.partitioning);
+	clustering_key.Add(params.block_size);
+	clustering_key.Add(params.max_points);
+	clustering_key.Add(params.max_cameras);
+	clustering_key.Add(params.min_points);
+	clustering_key.Add(params.min_cameras);
+	clustering_key.Add(params.max_distance);
+
+	// The state of the last run does not depend on the input files, which grow between runs in
+	// incremental mode, but on all the parameters that change the written clusters
+
+	SnapshotKey state_key;
+	state_key.Add(params.num_cameras);
+	state_key.Add(params.keyframe_step);
+	state_key.Add(alpha);
+	state_key.Add(params.partitioning);
+	state_key.Add(params.block_size);
+	state_key.Add(params.max_points);
+	state_key.Add(params.max_cameras);
+	state_key.Add(params.min_points);
+	state_key.Add(params.min_cameras);
+	state_key.Add(params.max_distance);
+	state_key.Add(params.num_neighbors);
+	state_key.Add(params.theta_0);
+	state_key.Add(params.sigma_0);
+	state_key.Add(params.sigma_1);
+	state_key.Add(params.output_folder);
+	state_key.Add(params.colmap_format);
+	state_key.Add(params.image_folder);
+	state_key.Add(params.image_scale);
+	state_key.Add(params.pyramid_levels);
+
+	const std::string dataset_snapshot = params.snapshot_folder + "dataset.snap";
+	const std::string clustering_snapshot = params.snapshot_folder + "clustering.snap";
+	const std::string state_snapshot = params.snapshot_folder + "state.snap";
+
+	// Load input dataset
+
+	InputDataset dataset;
+	dataset.num_cameras = params.num_cameras;
+	dataset.keyframe_step = params.keyframe_step;
+	dataset.num_threads = params.num_threads;
+
+	profiler.StartStage("load_dataset_snapshot");
+	if (use_snapshots && has_inputs && dataset.LoadSnapshot(dataset_snapshot, dataset_key.Value()))
+	{
+		std::cout << "Loaded dataset snapshot with " << dataset.filt.size() << " keyframes and " 
+				  << dataset.points.size() << " visible points" << std::endl << std::endl;
+	}
+	else
+	{
+		if (!PrepareDataset(params, alpha, dataset))
+		{
+			return FinishRun(params, EXIT_FAILURE);
+		}
+
+		profiler.StartStage("save_dataset_snapshot");
+		if (use_snapshots && !dataset.SaveSnapshot(dataset_snapshot, dataset_key.Value()))
+		{
+			std::cout << "Warning: failed to save the dataset snapshot" << std::endl << std::endl;
+		}
+	}
+
 	// Cluster points and cameras
 
-	std::cout << "Clustering points and cameras..." << std::endl;
 	Clustering clustering(dataset);
-	clustering.ClusterViews(params.block_size, params.min_points, params.min_cameras, params.max_distance);
-	std::cout << "Done! Built " << clustering.clusters.size() << " clusters" << std::endl << std::endl;
+	int num_old_images = 0;
+	profiler.StartStage("load_clustering_snapshot");
+	if (use_snapshots && has_inputs && clustering.LoadSnapshot(clustering_snapshot, clustering_key.Value()))
+	{
+		std::cout << "Loaded clustering snapshot with " << clustering.clusters.size() << " clusters" << std::endl << std::endl;
+	}
+	else if (params.incremental && use_snapshots && clustering.LoadState(state_snapshot, state_key.Value(), num_old_images))
+	{
+		std::cout << "Updating the " << clustering.clusters.size() << " clusters of the previous run with " 
+				  << dataset.images.size() - num_old_images << " new images..." << std::endl;
+		profiler.StartStage("update_clusters");
+		clustering.UpdateClusters(num_old_images, params.partitioning == "quadtree", params.block_size, params.max_points, 
+								  params.max_cameras, params.min_points, params.min_cameras, params.max_distance);
+		std::cout << "Done! There are " << clustering.clusters.size() << " clusters" << std::endl << std::endl;
+	}
+	else
+	{
+		if (params.incremental)
+		{
+			std::cout << "No usable state of a previous run, clustering from scratch" << std::endl;
+		}
+
+		std::cout << "Clustering points and cameras..." << std::endl;
+		profiler.StartStage("cluster");
+		clustering.ClusterViews(params.partitioning == "quadtree", params.block_size, params.max_points, params.max_cameras, 
+								params.min_points, params.min_cameras, params.max_distance);
+		std::cout << "Done! Built " << clustering.clusters.size() << " clusters" << std::endl << std::endl;
+
+		profiler.StartStage("save_clustering_snapshot");
+		if (use_snapshots && !clustering.SaveSnapshot(clustering_snapshot, clustering_key.Value()))
+		{
+			std::cout << "Warning: failed to save the clustering snapshot" << std::endl << std::endl;
+		}
+	}
 
+	profiler.StopStage();
+	profiler.Count("clusters", clustering.clusters.size());
 	clustering.PrintReport();
 
 	// Compute neighbors
 
 	std::cout << "Computing neighbors for each cluster..." << std::endl;
-	clustering.ComputeNeighbors(params.num_neighbors, params.sigma_0, params.sigma_1, params.theta_0);
+	profiler.StartStage("neighbors");
+	clustering.ComputeNeighbors(params.num_neighbors, params.sigma_0, params.sigma_1, params.theta_0, 
+								params.neighbor_engine == "inverted");
 	std::cout << "Done!" << std::endl << std::endl;
 
+	if (params.report_speedup)
+	{
+		std::cout << "Benchmarking view selection scoring kernels..." << std::endl;
+		profiler.StartStage("benchmark_kernels");
+		clustering.BenchmarkScoreKernels(params.sigma_0, params.sigma_1, params.theta_0);
+		std::cout << "Done!" << std::endl << std::endl;
+	}
+
 	// Write files in COLMAP format
 
 	std::cout << "Saving results in COLMAP format..." << std::endl;
-	if (!clustering.WriteColmapFiles(params.output_folder))
+	profiler.StartStage("write_colmap");
+	if (!clustering.WriteColmapFiles(params.output_folder, params.colmap_format == "binary"))
 	{
 		std::cout << "Failed to save results in COLMAP format" << std::endl;
-		return EXIT_FAILURE;
+		return FinishRun(params, EXIT_FAILURE);
 	}
 	std::cout << "Done!" << std::endl << std::endl;
 
 	// Write files in standard format
 
 	std::cout << "Saving results in standard format..." << std::endl;
+	profiler.StartStage("write_clusters");
 	if (!clustering.WriteClustersFiles(params.output_folder, params.num_neighbors))
 	{
 		std::cout << "Failed to save results in standard format" << std::endl;
-		return EXIT_FAILURE;
+		return FinishRun(params, EXIT_FAILURE);
 	}
 	std::cout << "Done!" << std::endl << std::endl;
 
-	return EXIT_SUCCESS;
+	// Export images
+
+	std::cout << "Exporting images..." << std::endl;
+	profiler.StartStage("export_images");
+	if (!clustering.ExportImages(params.output_folder, params.image_folder, params.image_scale, params.pyramid_levels))
+	{
+		std::cout << "Failed to export images" << std::endl;
+		return FinishRun(params, EXIT_FAILURE);
+	}
+	std::cout << "Done!" << std::endl << std::endl;
+
+	profiler.StartStage("save_state");
+	if (use_snapshots && !clustering.SaveState(state_snapshot, state_key.Value()))
+	{
+		std::cout << "Warning: failed to save the state of this run" << std::endl << std::endl;
+	}
+	profiler.StopStage();
+
+	return FinishRun(params, EXIT_SUCCESS);
 }
\ No newline at end of file